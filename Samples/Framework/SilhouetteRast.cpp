@@ -9,6 +9,7 @@
 #include "SilhouetteRast.h"
 #include "../../SimdRast/SimdMath.h"
 #include "../../SimdRast/IndexProvider.h"
+#include <algorithm>
 #include <new>
 
 using namespace srast;
@@ -67,15 +68,13 @@ SRAST_FORCEINLINE void rasterizeEdge(int2 start, int2 end, ImportanceMap& import
 }
 
 template<class T>
-static void rasterizeDrawCallSilhouettes(Renderer& r, DrawCall& drawCall, T indices, unsigned start, unsigned end, unsigned thread) {
-	float4* __restrict shadedPositions = drawCall.shadedPositions;
-	unsigned char* __restrict flags = drawCall.flags;
+static void rasterizeDrawCallSilhouettes(Renderer& r, DrawCall& drawCall, float4* __restrict shadedPositions, unsigned char* __restrict flags, T indices, unsigned start, unsigned end, unsigned thread) {
 	const unsigned* __restrict adjacency = drawCall.adjacency;
 	
 	ImportanceMap& importanceMap = r.getImportanceMap();
 	
-	unsigned width = r.getFrameBufferWidth();
-	unsigned height = r.getFrameBufferHeight();
+	unsigned width = r.getRegionWidth();
+	unsigned height = r.getRegionHeight();
 
 	simd4_float halfViewport = simd4_float((float)(int)width, (float)(int)height, (float)(int)width, (float)(int)height)*0.5f;
 	
@@ -221,41 +220,60 @@ static void rasterizeDrawCallSilhouettes(Renderer& r, DrawCall& drawCall, T indi
 	}
 }
 
+// Instances are rasterized one at a time with their own positions and flags.
 template<class T>
+static void rasterizeInstanceSilhouettes(Renderer& r, DrawCall& drawCall, T indices, unsigned start, unsigned end, unsigned thread) {
+	unsigned indexCount = 3*drawCall.instanceTriangleCount();
+	
+	while (start < end) {
+		unsigned instance = start / indexCount;
+		unsigned first = start - instance*indexCount;
+		unsigned last = first + std::min(end - start, indexCount - first);
+		
+		rasterizeDrawCallSilhouettes(r, drawCall, drawCall.shadedPositions + instance*drawCall.vertexBuffer.count,
+									 drawCall.flags + instance*(indexCount/3), indices, first, last, thread);
+		start += last - first;
+	}
+}
+
 class SilhouetteTask : public ThreadPoolTask {
 private:
 	Renderer& r;
-	DrawCall& drawCall;
-	T indices;
+	DrawCallBatch& batch;
 	
 public:
-	SilhouetteTask(Renderer& r, DrawCall& drawCall, T indices) : r(r), drawCall(drawCall), indices(indices) {
+	SilhouetteTask(Renderer& r, DrawCallBatch& batch) : r(r), batch(batch) {
 	}
 	
 	virtual void run(unsigned start, unsigned end, unsigned thread) {
-		rasterizeDrawCallSilhouettes(r, drawCall, indices, start, end, thread);
+		for (unsigned i = batch.drawCallAt(batch.triangleStarts, start); start < end; ++i) {
+			DrawCall& drawCall = batch.drawCalls[i];
+			unsigned first = batch.triangleStarts[i];
+			unsigned last = std::min(end, batch.triangleStarts[i+1]);
+			unsigned count = std::min(last - first, drawCall.triangleCount());
+			
+			if (start - first >= count) {
+				start = last;
+				continue;
+			}
+			
+			if (drawCall.indexBuffer.stride == 1)
+				rasterizeInstanceSilhouettes(r, drawCall, IndexProvider<unsigned char>(drawCall.indexBuffer.data), 3*(start - first), 3*count, thread);
+			else if (drawCall.indexBuffer.stride == 2)
+				rasterizeInstanceSilhouettes(r, drawCall, IndexProvider<unsigned short>(drawCall.indexBuffer.data), 3*(start - first), 3*count, thread);
+			else if (drawCall.indexBuffer.stride == 4)
+				rasterizeInstanceSilhouettes(r, drawCall, IndexProvider<unsigned int>(drawCall.indexBuffer.data), 3*(start - first), 3*count, thread);
+			else
+				rasterizeInstanceSilhouettes(r, drawCall, IndexProvider<>(), 3*(start - first), 3*count, thread);
+			
+			start = last;
+		}
 	}
 };
 
-void rasterizeDrawCallSilhouettes(Renderer& r, DrawCall& drawCall) {
-	ThreadPool& threadPool = r.getThreadPool();
-	
-	if (drawCall.indexBuffer.stride == 1) {
-		SilhouetteTask<IndexProvider<unsigned char> >* t = new (drawCall.task) SilhouetteTask<IndexProvider<unsigned char> >(r, drawCall, IndexProvider<unsigned char>(drawCall.indexBuffer.data));
-		threadPool.startTask(t, drawCall.indexBuffer.count, 3*1024);
-	}
-	else if (drawCall.indexBuffer.stride == 2) {
-		SilhouetteTask<IndexProvider<unsigned short> >* t = new (drawCall.task) SilhouetteTask<IndexProvider<unsigned short> >(r, drawCall, IndexProvider<unsigned short>(drawCall.indexBuffer.data));
-		threadPool.startTask(t, drawCall.indexBuffer.count, 3*1024);
-	}
-	else if (drawCall.indexBuffer.stride == 4) {
-		SilhouetteTask<IndexProvider<unsigned int> >* t = new (drawCall.task) SilhouetteTask<IndexProvider<unsigned int> >(r, drawCall, IndexProvider<unsigned int>(drawCall.indexBuffer.data));
-		threadPool.startTask(t, drawCall.indexBuffer.count, 3*1024);
-	}
-	else {
-		SilhouetteTask<IndexProvider<> >* t = new (drawCall.task) SilhouetteTask<IndexProvider<> >(r, drawCall, IndexProvider<>());
-		threadPool.startTask(t, drawCall.vertexBuffer.count, 3*1024);
-	}
+void rasterizeDrawCallSilhouettes(Renderer& r, DrawCallBatch& batch) {
+	SilhouetteTask* t = new (batch.task) SilhouetteTask(r, batch);
+	r.getThreadPool().startTask(t, batch.triangleCount(), 1024);
 }
 	
 }
@@ -13,7 +13,7 @@
 
 namespace fx {
 
-void rasterizeDrawCallSilhouettes(srast::Renderer& r, srast::DrawCall& drawCall);
+void rasterizeDrawCallSilhouettes(srast::Renderer& r, srast::DrawCallBatch& batch);
 
 }
 
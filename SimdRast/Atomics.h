@@ -52,6 +52,16 @@ public:
 		return InterlockedCompareExchange(reinterpret_cast<volatile LONG*>(i), newValue, oldValue);
 #else
 		return __sync_val_compare_and_swap(i, oldValue, newValue);
+#endif
+	}
+	
+	static int loadAcquire(const int* i) {
+#ifdef _WIN32
+		int x = *reinterpret_cast<const volatile int*>(i);
+		_ReadWriteBarrier();
+		return x;
+#else
+		return __atomic_load_n(i, __ATOMIC_ACQUIRE);
 #endif
 	}
 };
@@ -65,8 +65,8 @@ struct BinList {
 	unsigned frameNumber;
 	unsigned firstBlockOffset;
 	unsigned currentBlockOffset;
-	unsigned short currentSize;
-	unsigned short currentDrawCall;
+	unsigned currentSize : 8;
+	unsigned currentDrawCall : 24;
 
 	SRAST_FORCEINLINE Reader finalize(PoolAllocator& poolAllocator) const {
 		unsigned* start = poolAllocator.basePointer<unsigned>();
@@ -118,7 +118,7 @@ struct BinList {
 		
 		if (written > 1) {
 			if (written & 1)
-				currentDrawCall = (unsigned short)(*block & (~0x80000000));
+				currentDrawCall = *block & 0x00ffffff;
 			
 			currentBlockOffset += written;
 			currentSize -= written;
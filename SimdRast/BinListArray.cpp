@@ -10,6 +10,11 @@
 
 namespace srast {
 
+// Allocations are padded to whole 64-byte blocks so the clears can stream full blocks.
+static size_t blockPadded(size_t size) {
+	return (size + 63) & ~(size_t)63;
+}
+
 BinListArray::BinListArray(ThreadPool& threadPool) {
 	width = 0;
 	height = 0;
@@ -17,6 +22,8 @@ BinListArray::BinListArray(ThreadPool& threadPool) {
 	threadCount = threadPool.getThreadCount();
 	threadBinListArrays = static_cast<BinList**>(simd_malloc(sizeof(BinList*) * threadCount, 64));
 	std::fill(threadBinListArrays, threadBinListArrays + threadPool.getThreadCount(), static_cast<BinList*>(0));
+	threadEntryCounts = static_cast<unsigned**>(simd_malloc(sizeof(unsigned*) * threadCount, 64));
+	std::fill(threadEntryCounts, threadEntryCounts + threadPool.getThreadCount(), static_cast<unsigned*>(0));
 }
 
 void BinListArray::resize(unsigned width, unsigned height) {
@@ -33,13 +40,18 @@ void BinListArray::resize(unsigned width, unsigned height) {
 		if (threadBinListArrays[i])
 			simd_free(threadBinListArrays[i]);
 		
-		threadBinListArrays[i] = static_cast<BinList*>(simd_malloc(sizeof(BinList)*width*height, 64));
+		threadBinListArrays[i] = static_cast<BinList*>(simd_malloc(blockPadded(sizeof(BinList)*width*height), 64));
+		
+		if (threadEntryCounts[i])
+			simd_free(threadEntryCounts[i]);
+		
+		threadEntryCounts[i] = static_cast<unsigned*>(simd_malloc(sizeof(unsigned)*width*height, 64));
 	}
 
 	if (zmax)
 		simd_free(zmax);
 	
-	zmax = static_cast<unsigned*>(simd_malloc(sizeof(unsigned)*width*height, 64));
+	zmax = static_cast<unsigned*>(simd_malloc(blockPadded(sizeof(unsigned)*width*height), 64));
 	
 	clear();
 }
@@ -51,7 +63,7 @@ void BinListArray::clear() {
 
 void BinListArray::clearZ() {
 	float* dst = reinterpret_cast<float*>(zmax);
-	unsigned size = width*height;
+	unsigned size = (unsigned)(blockPadded(sizeof(unsigned)*width*height)/sizeof(float));
 	
 	__m128 z = _mm_set1_ps(SRAST_FAR_Z);
 	
@@ -65,7 +77,7 @@ void BinListArray::clearZ() {
 
 void BinListArray::clear(unsigned thread) {
 	float* dst = reinterpret_cast<float*>(threadBinListArrays[thread]);
-	unsigned size = (sizeof(BinList)/sizeof(float))*width*height;
+	unsigned size = (unsigned)(blockPadded(sizeof(BinList)*width*height)/sizeof(float));
 	
 	__m128 z = _mm_setzero_ps();
 	
@@ -81,8 +93,11 @@ BinListArray::~BinListArray() {
 	for (unsigned i = 0; i < threadCount; ++i) {
 		if (threadBinListArrays[i])
 			simd_free(threadBinListArrays[i]);
+		if (threadEntryCounts[i])
+			simd_free(threadEntryCounts[i]);
 	}
 	simd_free(threadBinListArrays);
+	simd_free(threadEntryCounts);
 	if (zmax)
 		simd_free(zmax);
 }
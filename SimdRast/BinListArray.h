@@ -24,12 +24,21 @@ private:
 	BinList** threadBinListArrays;
 	unsigned width, height;
 	unsigned* zmax;
+	unsigned** threadEntryCounts;
 
 public:
 	BinListArray(ThreadPool& threadPool);
 	
 	void resize(unsigned width, unsigned height);
 
+	unsigned getWidth() const {
+		return width;
+	}
+
+	unsigned getHeight() const {
+		return height;
+	}
+
 	SRAST_FORCEINLINE BinList* operator () (unsigned x, unsigned y, unsigned thread, unsigned frameNumber, unsigned*& zmax) const {
 		x >>= tileSizeLog2;
 		y >>= tileSizeLog2;
@@ -42,6 +51,7 @@ public:
 		if (list->frameNumber != frameNumber) {
 			list->frameNumber = frameNumber;
 			list->reset();
+			threadEntryCounts[thread][idx] = 0;
 		}
 		return list;
 	}
@@ -59,6 +69,22 @@ public:
 
 		return zmax[idx];
 	}
+
+	SRAST_FORCEINLINE void addEntries(unsigned x, unsigned y, unsigned thread, unsigned count) {
+		x >>= tileSizeLog2;
+		y >>= tileSizeLog2;
+		threadEntryCounts[thread][y*width + x] += count;
+	}
+
+	// Bin entries written to a tile this frame, summed over all threads. Counts are reset along with the bin.
+	SRAST_FORCEINLINE unsigned entries(unsigned idx, unsigned frameNumber) const {
+		unsigned count = 0;
+		for (unsigned thread = 0; thread < threadCount; ++thread) {
+			if (threadBinListArrays[thread][idx].frameNumber == frameNumber)
+				count += threadEntryCounts[thread][idx];
+		}
+		return count;
+	}
 	
 	void clear();
 
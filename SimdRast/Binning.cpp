@@ -8,6 +8,7 @@
 
 #include "Binning.h"
 #include "SimdMath.h"
+#include "SimdDouble.h"
 #include "ZMode.h"
 
 namespace srast {
@@ -25,6 +26,19 @@ inline vec4<simd4_float> decodeBoundingBox(const __m128i& bbXY, const __m128i& b
 	return bb;
 }
 
+// Approximate edge constants in pixels, followed by z.
+inline __m128 loadEdgeConstants(const TriangleEdges& edges) {
+	__m128i c01 = _mm_load_si128(reinterpret_cast<const __m128i*>(edges.c) + 0);
+	__m128i c2z = _mm_load_si128(reinterpret_cast<const __m128i*>(edges.c) + 1);
+	
+	simd2_double scale(1.0/512.0);
+	
+	__m128 c01f = double2float(int64_to_double(c01) * scale).mm;
+	__m128 c2f = double2float(int64_to_double(c2z) * scale).mm;
+	
+	return _mm_movelh_ps(c01f, _mm_unpacklo_ps(c2f, _mm_movehl_ps(_mm_castsi128_ps(c2z), _mm_castsi128_ps(c2z))));
+}
+
 #define GATHER_TRIANGLE_FF(m0, m1, m2, m3, idx) \
 	__m128 m0, m1, m2, m3 = _mm_setzero_ps();\
 while (i < end) {\
@@ -32,10 +46,10 @@ if (*(flags++) & FACEFLAG_BACK) {\
 ++i;\
 continue;\
 }\
-m0 = _mm_load_ps(&edges[i*4+0].x);\
-m1 = _mm_load_ps(&edges[i*4+1].x);\
-m2 = _mm_load_ps(&edges[i*4+2].x);\
-m3 = _mm_load_ps(&edges[i*4+3].x);\
+m0 = _mm_load_ps(reinterpret_cast<const float*>(edges[i].a));\
+m1 = _mm_load_ps(reinterpret_cast<const float*>(edges[i].b));\
+m2 = loadEdgeConstants(edges[i]);\
+m3 = _mm_load_ps(reinterpret_cast<const float*>(&edges[i].bbMin));\
 laneMask += laneMask + 1;\
 triangleIndex[idx] = i;\
 ++i;\
@@ -49,10 +63,10 @@ if (*(flags++) & FACEFLAG_BACK) {\
 ++i;\
 continue;\
 }\
-m0 = _mm256_castps128_ps256(_mm_load_ps(&edges[i*4+0].x));\
-m1 = _mm256_castps128_ps256(_mm_load_ps(&edges[i*4+1].x));\
-m2 = _mm256_castps128_ps256(_mm_load_ps(&edges[i*4+2].x));\
-m3 = _mm256_castps128_ps256(_mm_load_ps(&edges[i*4+3].x));\
+m0 = _mm256_castps128_ps256(_mm_load_ps(reinterpret_cast<const float*>(edges[i].a)));\
+m1 = _mm256_castps128_ps256(_mm_load_ps(reinterpret_cast<const float*>(edges[i].b)));\
+m2 = _mm256_castps128_ps256(loadEdgeConstants(edges[i]));\
+m3 = _mm256_castps128_ps256(_mm_load_ps(reinterpret_cast<const float*>(&edges[i].bbMin)));\
 laneMask += laneMask + 1;\
 triangleIndex[idx] = i;\
 ++i;\
@@ -65,10 +79,10 @@ if (*(flags++) & FACEFLAG_BACK) {\
 ++i;\
 continue;\
 }\
-m0 = _mm256_insertf128_ps(m0, _mm_load_ps(&edges[i*4+0].x), 1);\
-m1 = _mm256_insertf128_ps(m1, _mm_load_ps(&edges[i*4+1].x), 1);\
-m2 = _mm256_insertf128_ps(m2, _mm_load_ps(&edges[i*4+2].x), 1);\
-m3 = _mm256_insertf128_ps(m3, _mm_load_ps(&edges[i*4+3].x), 1);\
+m0 = _mm256_insertf128_ps(m0, _mm_load_ps(reinterpret_cast<const float*>(edges[i].a)), 1);\
+m1 = _mm256_insertf128_ps(m1, _mm_load_ps(reinterpret_cast<const float*>(edges[i].b)), 1);\
+m2 = _mm256_insertf128_ps(m2, loadEdgeConstants(edges[i]), 1);\
+m3 = _mm256_insertf128_ps(m3, _mm_load_ps(reinterpret_cast<const float*>(&edges[i].bbMin)), 1);\
 laneMask += laneMask + 1;\
 triangleIndex[idx] = i;\
 ++i;\
@@ -77,7 +91,7 @@ break;\
 
 template<class ZMode, bool Opaque>
 void binDrawCallInMode(Renderer& r, DrawCall& drawCall, unsigned start, unsigned end, int maxLevel, unsigned thread) {
-	float4* __restrict edges = drawCall.edges;
+	const TriangleEdges* __restrict edges = drawCall.edges;
 	unsigned char* __restrict flags = drawCall.flags + start;
 	
 	const ImportanceMap& importanceMap = r.importanceMap;
@@ -86,8 +100,8 @@ void binDrawCallInMode(Renderer& r, DrawCall& drawCall, unsigned start, unsigned
 	
 	unsigned drawCallIdx = (unsigned)(&drawCall - &r.drawCalls[0]);
 	
-	unsigned width = r.frameBufferWidth;
-	unsigned height = r.frameBufferHeight;
+	unsigned width = r.regionWidth;
+	unsigned height = r.regionHeight;
 	unsigned frameNumber = r.frameNumber;
 	
 	for (unsigned i = start; i < end; ) {
@@ -129,9 +143,9 @@ void binDrawCallInMode(Renderer& r, DrawCall& drawCall, unsigned start, unsigned
 		_MM_TRANSPOSE4_PS(m03, m13, m23, m33);
 #endif
 		
-		simd_float3 edge0(m00, m10, m20);
-		simd_float3 edge1(m01, m11, m21);
-		simd_float3 edge2(m02, m12, m22);
+		simd_float3 edge0(int32_to_float(m00) * (1.0f / 16.0f), int32_to_float(m01) * (1.0f / 16.0f), m02);
+		simd_float3 edge1(int32_to_float(m10) * (1.0f / 16.0f), int32_to_float(m11) * (1.0f / 16.0f), m12);
+		simd_float3 edge2(int32_to_float(m20) * (1.0f / 16.0f), int32_to_float(m21) * (1.0f / 16.0f), m22);
 		
 		simd_float ez0(m30);
 		simd_float ez1(m31);
@@ -302,6 +316,8 @@ void binDrawCallInMode(Renderer& r, DrawCall& drawCall, unsigned start, unsigned
 						SRAST_SIMD_ALIGNED float zmaxa[simd_float::width];
 						zmin.store(zmina);
 						zmax.store(zmaxa);
+						
+						unsigned entries = 0;
 					
 						for (unsigned l = 0; l < simd_float::width; ++l) {
 							unsigned zmini = float_as_uint32(zmina[l]);
@@ -319,8 +335,12 @@ void binDrawCallInMode(Renderer& r, DrawCall& drawCall, unsigned start, unsigned
 								}
 
 								binWriter.writeTriangle(triangleIndex[l], zmini);
+								++entries;
 							}
 						}
+						
+						if (entries)
+							binListArray.addEntries(left, top, thread, entries);
 
 						if (ZMode::less(binZmax, oldBinZmax)) {
 							unsigned newValue = binZmax;
@@ -21,6 +21,12 @@
 #define SRAST_FORCEINLINE __attribute__((always_inline))
 #endif
 
+#ifdef _WIN32
+#define SRAST_NOINLINE __declspec(noinline)
+#else
+#define SRAST_NOINLINE __attribute__((noinline))
+#endif
+
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
@@ -30,4 +36,8 @@
 #define SRAST_AVX
 #endif
 
+#if defined(__F16C__) || defined(__AVX2__)
+#define SRAST_F16C
+#endif
+
 #endif
@@ -13,6 +13,7 @@
 #include "ThreadPool.h"
 #include "VertexRenderState.h"
 #include "FragmentRenderState.h"
+#include <algorithm>
 
 namespace srast {
 
@@ -38,6 +39,26 @@ struct DrawBuffer {
 	}
 };
 
+/*
+ Fixed-point triangle setup. Edge functions are e(x, y) = a*x + b*y + c, where a and b are 28.4
+ and x, y are in 1/32 pixels relative to the center of the screen. This makes c 1/512 pixels
+ and exact in 64 bits. The top-left fill convention is folded into c.
+ Depth is the plane z = dzdx*x + dzdy*y + z in pixels.
+*/
+struct SRAST_ALIGNED(16) TriangleEdges {
+	int a[3];
+	float dzdx;
+	int b[3];
+	float dzdy;
+	unsigned bbMin;
+	unsigned bbMax;
+	float zmin;
+	float zmax;
+	long long c[3];
+	float z;
+	unsigned padding;
+};
+
 struct DrawCall {
 	VertexRenderState vertexRenderState;
 	FragmentRenderState fragmentRenderState;
@@ -46,16 +67,61 @@ struct DrawCall {
 	DrawBuffer vertexBuffer;
 	DrawBuffer attributeBuffer;
 	DrawBuffer indexBuffer;
+	DrawBuffer instanceBuffer; // Per-instance vertex shader uniforms. Empty when not instanced.
 
 	float4* shadedPositions;
-	float4* edges;
-	double* highpEdgeZ0;
-	double* highpEdgeZ1;
-	double* highpEdgeZ2;
+	float4* frameShadedPositions; // Vertex shader output when rendering in regions or views.
+	float* shadedAttributes; // Attribute shader output, filled lazily by resolve.
+	unsigned* shadedPositionStates; // Claims of fused vertex shading. See TriangleSetup.cpp.
+	unsigned* shadedAttributeStates; // Kept across frames and stamped with the frame. See Resolve.cpp.
+	TriangleEdges* edges;
 	unsigned* adjacency;
 	unsigned char* flags;
+	unsigned long long triangleBase; // Triangles of earlier draw calls in the frame.
+	
+	// Instances follow each other in triangle order and in shadedPositions.
+	unsigned instanceCount() const {
+		return instanceBuffer.data ? instanceBuffer.count : 1;
+	}
+	
+	unsigned instanceTriangleCount() const {
+		return indexBuffer.stride ? indexBuffer.count/3 : vertexBuffer.count/3;
+	}
+	
+	unsigned triangleCount() const {
+		return instanceTriangleCount()*instanceCount();
+	}
+	
+	unsigned vertexCount() const {
+		return vertexBuffer.count*instanceCount();
+	}
+};
 
+// Consecutive draw calls that the front-end processes with one task per stage. Work items span draw calls.
+struct DrawCallBatch {
+	DrawCall* drawCalls;
+	unsigned drawCallCount;
+	unsigned* vertexStarts; // Prefix sums of vertices shaded up front, one more than the draw calls. Each draw call is padded to the SIMD width.
+	unsigned* triangleStarts; // Prefix sums of triangles, with each draw call padded like the vertices.
 	ThreadPoolTask* task;
+	
+	unsigned vertexCount() const {
+		return vertexStarts[drawCallCount];
+	}
+	
+	unsigned triangleCount() const {
+		return triangleStarts[drawCallCount];
+	}
+	
+	// The draw call that holds an item of a stage with the given prefix sums.
+	unsigned drawCallAt(const unsigned* starts, unsigned item) const {
+		return (unsigned)(std::upper_bound(starts, starts + drawCallCount + 1, item) - starts) - 1;
+	}
+	
+	// Spans are padded to the SIMD width so that work items only split draw calls where the SIMD stores of one item stay clear of the next.
+	static unsigned paddedCount(unsigned count) {
+		return (count + simd_float::width-1) & ~(simd_float::width-1);
+	}
 };
 
 }
@@ -29,6 +29,24 @@ struct IndexProvider<float> {
 	}
 };
 
+// Indices of one instance of an instanced draw call. Indices past the instance map to its first triangle, which keeps padding triangles in range.
+template<class T>
+struct InstanceIndexProvider {
+	T indices;
+	unsigned indexBase, indexCount;
+	int vertexBase;
+	InstanceIndexProvider(T indices, unsigned indexCount) : indices(indices), indexBase(0), indexCount(indexCount), vertexBase(0) {}
+	int3 operator () (unsigned index) const {
+		index -= indexBase;
+		
+		if (index >= indexCount)
+			index = 0;
+		
+		int3 ind = indices(index);
+		return int3(ind.x + vertexBase, ind.y + vertexBase, ind.z + vertexBase);
+	}
+};
+
 }
 
 #endif
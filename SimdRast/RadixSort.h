@@ -0,0 +1,121 @@
+//
+//  RadixSort.h
+//  SimdRast
+//
+//  Created by Rasmus Barringer on 2013-06-02.
+//  Copyright (c) 2013 Rasmus Barringer. All rights reserved.
+//
+
+#ifndef SimdRast_RadixSort_h
+#define SimdRast_RadixSort_h
+
+#include "Config.h"
+#include <emmintrin.h>
+#include <cstring>
+
+namespace srast {
+
+static const unsigned radixSortInsertionCutoff = 32;
+
+template<bool Descending>
+inline SRAST_FORCEINLINE bool radixLess(unsigned long long a, unsigned long long b) {
+	return Descending ? a > b : a < b;
+}
+
+template<bool Descending>
+inline SRAST_FORCEINLINE void insertionSort(unsigned long long* keys, unsigned count) {
+	for (unsigned i = 1; i < count; ++i) {
+		unsigned long long key = keys[i];
+		unsigned j = i;
+
+		for (; j > 0 && radixLess<Descending>(key, keys[j-1]); --j)
+			keys[j] = keys[j-1];
+
+		keys[j] = key;
+	}
+}
+
+// Returns the bits that differ between any two keys.
+inline SRAST_FORCEINLINE unsigned long long radixVaryingBits(const unsigned long long* keys, unsigned count) {
+	__m128i first = _mm_set1_epi64x((long long)keys[0]);
+	__m128i diff = _mm_setzero_si128();
+
+	unsigned i = 0;
+
+	for (; i+2 <= count; i += 2)
+		diff = _mm_or_si128(diff, _mm_xor_si128(first, _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i))));
+
+	diff = _mm_or_si128(diff, _mm_unpackhi_epi64(diff, diff));
+
+	unsigned long long result;
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(&result), diff);
+
+	if (i < count)
+		result |= keys[i] ^ keys[0];
+
+	return result;
+}
+
+/*
+ LSD radix sort of 64-bit keys, eight bits per pass. Digits that are equal in all keys are skipped,
+ which leaves a few passes for tile-local triangle and fragment keys. Scratch must hold count keys.
+*/
+template<bool Descending>
+void radixSort(unsigned long long* keys, unsigned long long* scratch, unsigned count) {
+	if (count <= radixSortInsertionCutoff) {
+		insertionSort<Descending>(keys, count);
+		return;
+	}
+
+	unsigned long long varying = radixVaryingBits(keys, count);
+	unsigned long long flip = Descending ? ~0ull : 0ull;
+
+	unsigned histograms[8][256];
+	unsigned passes[8];
+	unsigned passCount = 0;
+
+	for (unsigned p = 0; p < 8; ++p) {
+		if ((varying >> (p*8)) & 0xff) {
+			passes[passCount++] = p;
+			std::memset(histograms[p], 0, sizeof(histograms[p]));
+		}
+	}
+
+	for (unsigned i = 0; i < count; ++i) {
+		unsigned long long key = keys[i] ^ flip;
+
+		for (unsigned p = 0; p < passCount; ++p)
+			++histograms[passes[p]][(key >> (passes[p]*8)) & 0xff];
+	}
+
+	unsigned long long* src = keys;
+	unsigned long long* dst = scratch;
+
+	for (unsigned p = 0; p < passCount; ++p) {
+		unsigned shift = passes[p]*8;
+		unsigned* histogram = histograms[passes[p]];
+		unsigned offset = 0;
+
+		for (unsigned d = 0; d < 256; ++d) {
+			unsigned c = histogram[d];
+			histogram[d] = offset;
+			offset += c;
+		}
+
+		for (unsigned i = 0; i < count; ++i) {
+			unsigned long long key = src[i];
+			dst[histogram[((key ^ flip) >> shift) & 0xff]++] = key;
+		}
+
+		unsigned long long* t = src;
+		src = dst;
+		dst = t;
+	}
+
+	if (src != keys)
+		std::memcpy(keys, src, sizeof(unsigned long long)*count);
+}
+
+}
+
+#endif
@@ -10,6 +10,7 @@
 #define SimdRast_RenderState_h
 
 #include "Shader.h"
+#include <cstring>
 
 namespace srast {
 
@@ -18,6 +19,7 @@ protected:
 	unsigned mode;
 	Shader* shader;
 	const void* uniforms;
+	unsigned uniformSize;
 	
 public:
 	RenderState() {
@@ -28,11 +30,13 @@ public:
 		mode = 0;
 		shader = 0;
 		uniforms = 0;
+		uniformSize = 0;
 	}
 	
-	void setShader(Shader* shader, const void* uniforms) {
+	void setShader(Shader* shader, const void* uniforms, unsigned uniformSize = 0) {
 		this->shader = shader;
 		this->uniforms = uniforms;
+		this->uniformSize = uniformSize;
 	}
 	
 	Shader* getShader() const {
@@ -43,9 +47,19 @@ public:
 		shader->execute(input, output, count, uniforms);
 	}
 	
+	void executeShader(const void* input, void* output, unsigned count, const void* uniforms) const {
+		shader->execute(input, output, count, uniforms);
+	}
+	
 	bool operator != (const RenderState& rhs) const {
 		return mode != rhs.mode;
 	}
+	
+	// Same mode, shader and uniform contents.
+	bool matches(const RenderState& rhs) const {
+		return mode == rhs.mode && shader == rhs.shader && uniformSize == rhs.uniformSize &&
+			(uniforms == rhs.uniforms || std::memcmp(uniforms, rhs.uniforms, uniformSize) == 0);
+	}
 
 protected:
 	template<class T>
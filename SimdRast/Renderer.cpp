@@ -12,14 +12,64 @@
 #include "TriangleSetup.h"
 #include "IndexProvider.h"
 #include <new>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include <unordered_map>
 
 namespace srast {
 
+// Triangle setup is exact up to 8192x8192 pixels. See TriangleSetup.cpp.
+static const unsigned maxRegionSizeLimit = 8192;
+
+// Bin entries hold a triangle in 30 bits and a draw call in 24 bits. Fragment keys hold the frame triangle in 40 bits.
+static const unsigned maxDrawCallTriangles = 0x3fffffff;
+static const unsigned maxDrawCalls = 0x00ffffff;
+static const unsigned long long maxFrameTriangles = 0xfffffffffeull;
+
+// Built-in sample patterns as x, y pairs.
+static const float samplePattern1[] = {
+	0.5f, 0.5f,
+};
+
+static const float samplePattern4[] = {
+	0.375f, 0.125f, 0.875f, 0.375f, 0.125f, 0.625f, 0.625f, 0.875f,
+};
+
+static const float samplePattern8[] = {
+	0.5625f, 0.3125f, 0.4375f, 0.6875f, 0.8125f, 0.5625f, 0.3125f, 0.1875f,
+	0.1875f, 0.8125f, 0.0625f, 0.4375f, 0.6875f, 0.9375f, 0.9375f, 0.0625f,
+};
+
+static const float samplePattern16[] = {
+	0.031250f, 0.343750f, 0.093750f, 0.843750f, 0.156250f, 0.531250f, 0.218750f, 0.093750f,
+	0.281250f, 0.718750f, 0.343750f, 0.468750f, 0.406250f, 0.218750f, 0.468750f, 0.968750f,
+	0.531250f, 0.593750f, 0.593750f, 0.281250f, 0.656250f, 0.781250f, 0.718750f, 0.031250f,
+	0.781250f, 0.406250f, 0.843750f, 0.906250f, 0.906250f, 0.156250f, 0.968750f, 0.656250f,
+};
+
+// Sample locations must be multiples of 1/32 for the edge tests in resolve to be exact.
+static float snapSampleLocation(float x) {
+	return std::min(std::max(std::floor(x*32.0f + 0.5f), 0.0f), 31.0f) * (1.0f / 32.0f);
+}
+
 Renderer::Renderer() : poolAllocator(1024*1024*1024), binListArray(threadPool), compositeBinListArray(threadPool), localAllocators(poolAllocator, threadPool) {
+	// Attribute cache states claim vertices by thread in 12 bits. See Resolve.cpp.
+	if (threadPool.getThreadCount() >= 0xfff)
+		throw std::runtime_error("too many threads");
+	
 	frameNumber = 0;
+	stateStamp = 0;
+	frameBufferFormat = FRAMEBUFFERFORMAT_RGBA8;
+	
+	for (unsigned i = 0; i < 3; ++i) {
+		currentShader[i] = 0;
+		currentUniforms[i] = 0;
+		currentUniformSize[i] = 0;
+	}
+	
 	reset();
 }
 
@@ -33,6 +83,54 @@ FragmentRenderState& Renderer::getFragmentRenderState() {
 
 void Renderer::setClearColor(unsigned color) {
 	clearColor = color;
+	clearColorFloat = float4((float)(color & 0xff), (float)((color >> 8) & 0xff), (float)((color >> 16) & 0xff), (float)(color >> 24)) * (1.0f/255.0f);
+}
+
+void Renderer::setClearColor(const float4& color) {
+	clearColorFloat = color;
+	clearColor = 0;
+	
+	for (unsigned i = 0; i < 4; ++i)
+		clearColor |= (unsigned)(std::min(std::max((&color.x)[i], 0.0f), 1.0f)*255.0f + 0.5f) << (i*8);
+}
+
+void Renderer::setSampleCount(unsigned count) {
+	switch (count) {
+		case 1:
+			setSamplePattern(count, samplePattern1);
+			break;
+		case 4:
+			setSamplePattern(count, samplePattern4);
+			break;
+		case 8:
+			setSamplePattern(count, samplePattern8);
+			break;
+		case 16:
+			setSamplePattern(count, samplePattern16);
+			break;
+		default:
+			throw std::runtime_error("invalid sample count");
+	}
+}
+
+void Renderer::setSamplePattern(unsigned count, const float* locations) {
+	// The 16-bit sample mask of a fragment limits the count to 16.
+	if (count != 1 && count != 4 && count != 8 && count != 16)
+		throw std::runtime_error("invalid sample count");
+	
+	SamplePattern* pattern = static_cast<SamplePattern*>(poolAllocator.allocate(sizeof(SamplePattern)));
+	
+	for (unsigned i = 0; i < maxSamplesPerPixel; ++i) {
+		pattern->x[i] = snapSampleLocation(locations[(i % count)*2 + 0]);
+		pattern->y[i] = snapSampleLocation(locations[(i % count)*2 + 1]);
+	}
+	
+	samplesPerPixelLog2 = 0;
+	
+	while ((1u << samplesPerPixelLog2) < count)
+		++samplesPerPixelLog2;
+	
+	samplePattern = pattern;
 }
 
 void Renderer::forceDense() {
@@ -43,8 +141,40 @@ void Renderer::forceTransparentImportance() {
 	transparentImportance = true;
 }
 
-void Renderer::setupHimRasterization(void (*rasterizeDrawCallToHim)(Renderer& r, DrawCall& drawCall)) {
-	this->rasterizeDrawCallToHim = rasterizeDrawCallToHim;
+void Renderer::forceOrderIndependentTransparency() {
+	orderIndependentTransparency = true;
+}
+
+void Renderer::forceDepthOnly(COVERAGEMODE coverage) {
+	depthOnly = true;
+	conservativeCoverage = coverage == COVERAGEMODE_CONSERVATIVE;
+	setSampleCount(1);
+}
+
+void Renderer::forceFusedVertexShading() {
+	fusedVertexShading = true;
+}
+
+void Renderer::forceRegionSize(unsigned size) {
+	if (size == 0 || size > maxRegionSizeLimit || size & ((1 << tileSizeLog2)-1))
+		throw std::runtime_error("invalid region size");
+	
+	maxRegionSize = size;
+}
+
+void Renderer::setupHimRasterization(void (*rasterizeDrawCallsToHim)(Renderer& r, DrawCallBatch& batch)) {
+	this->rasterizeDrawCallsToHim = rasterizeDrawCallsToHim;
+}
+
+static unsigned frameBufferPixelSize(FRAMEBUFFERFORMAT format) {
+	switch (format) {
+		case FRAMEBUFFERFORMAT_RGBA16F:
+			return 8;
+		case FRAMEBUFFERFORMAT_RGBA32F:
+			return 16;
+		default:
+			return 4;
+	}
 }
 
 void Renderer::bindFrameBuffer(FRAMEBUFFERFORMAT format, void* frameBuffer, unsigned width, unsigned height, unsigned pitch) {
@@ -53,8 +183,46 @@ void Renderer::bindFrameBuffer(FRAMEBUFFERFORMAT format, void* frameBuffer, unsi
 	frameBufferWidth = width;
 	frameBufferHeight = height;
 	frameBufferPitch = pitch;
-	importanceMap.resize(width, height);
-	binListArray.resize(width, height);
+	
+	regionCountX = (width + maxRegionSize-1) / maxRegionSize;
+	regionCountY = (height + maxRegionSize-1) / maxRegionSize;
+	
+	unsigned tileMask = (1 << tileSizeLog2)-1;
+	regionStrideX = ((width + regionCountX-1) / regionCountX + tileMask) & ~tileMask;
+	regionStrideY = ((height + regionCountY-1) / regionCountY + tileMask) & ~tileMask;
+	
+	setRegion(0);
+}
+
+void Renderer::bindDepthBuffer(DEPTHBUFFERFORMAT format, void* depthBuffer, unsigned pitch) {
+	this->depthBuffer = depthBuffer;
+	depthBufferFormat = format;
+	depthBufferPitch = pitch;
+}
+
+void Renderer::addView(const float4x4& transform, void* frameBuffer, void* depthBuffer) {
+	RenderView v;
+	v.transform = transform;
+	v.frameBuffer = frameBuffer;
+	v.depthBuffer = depthBuffer;
+	views.push_back(v);
+}
+
+void Renderer::setView(unsigned view) {
+	const RenderView& v = views[view];
+	viewTransform = v.transform;
+	frameBuffer = v.frameBuffer;
+	depthBuffer = v.depthBuffer;
+}
+
+void Renderer::setRegion(unsigned region) {
+	regionX = (region % regionCountX)*regionStrideX;
+	regionY = (region / regionCountX)*regionStrideY;
+	regionWidth = std::min(regionStrideX, frameBufferWidth - regionX);
+	regionHeight = std::min(regionStrideY, frameBufferHeight - regionY);
+	
+	importanceMap.resize(regionWidth, regionHeight);
+	binListArray.resize(regionWidth, regionHeight);
 }
 
 void Renderer::bindIndexBuffer(void* indexBuffer, unsigned offset, unsigned size, unsigned count) {
@@ -116,14 +284,14 @@ void Renderer::bindShader(SHADERKIND shaderKind, Shader* shader, const void* uni
 	
 	currentShader[shaderKind] = shader;
 	currentUniforms[shaderKind] = poolAllocator.clone(uniforms, uniformSize);
+	currentUniformSize[shaderKind] = uniformSize;
 }
 
 void Renderer::drawList() {
 	DrawCall d = currentDrawCall;
 
 	d.indexBuffer.clear();
-	setupShaders(d);
-	drawCalls.push_back(d);
+	addDrawCall(d);
 }
 
 void Renderer::drawIndexed() {
@@ -132,53 +300,436 @@ void Renderer::drawIndexed() {
 	if (!d.indexBuffer.data)
 		throw std::runtime_error("no index buffer bound");
 	
+	addDrawCall(d);
+}
+
+void Renderer::drawIndexedInstanced(unsigned instanceCount, void* instanceBuffer, unsigned stride) {
+	DrawCall d = currentDrawCall;
+	
+	if (!d.indexBuffer.data)
+		throw std::runtime_error("no index buffer bound");
+	
+	if (stride & 0xf || reinterpret_cast<unsigned long long>(instanceBuffer) & 0xf)
+		throw std::runtime_error("invalid instance buffer alignment");
+	
+	if ((unsigned long long)d.instanceTriangleCount()*instanceCount > maxDrawCallTriangles)
+		throw std::runtime_error("too many triangles in draw call");
+	
+	if (instanceCount == 0)
+		return;
+	
+	d.instanceBuffer.data = instanceBuffer;
+	d.instanceBuffer.stride = stride;
+	d.instanceBuffer.count = instanceCount;
+	
+	addDrawCall(d);
+}
+
+void Renderer::addDrawCall(DrawCall& d) {
+	if (d.triangleCount() > maxDrawCallTriangles)
+		throw std::runtime_error("too many triangles in draw call");
+	
+	if (drawCalls.size() >= maxDrawCalls)
+		throw std::runtime_error("too many draw calls");
+	
+	d.triangleBase = drawCalls.empty() ? 0 : drawCalls.back().triangleBase + drawCalls.back().triangleCount();
+	
+	if (d.triangleBase + d.triangleCount() > maxFrameTriangles)
+		throw std::runtime_error("too many triangles in frame");
+	
 	setupShaders(d);
 	drawCalls.push_back(d);
 }
 
-class VertexShadeTask : public ThreadPoolTask {
+// Finds the vertex base of b when merged after a with vertex base aBase. Vertices are either shared or follow each other in memory.
+static bool mergeVertexBase(const DrawCall& a, const DrawCall& b, unsigned aBase, unsigned& bBase) {
+	if (a.instanceBuffer.data || b.instanceBuffer.data || !a.indexBuffer.stride != !b.indexBuffer.stride || !a.adjacency != !b.adjacency)
+		return false;
+	
+	// Adjacency of list draw calls belongs to an earlier index buffer.
+	if (!a.indexBuffer.stride && a.adjacency)
+		return false;
+	
+	// Vertices of a list draw call that don't form a whole triangle would join the next draw call's first triangle.
+	if (!a.indexBuffer.stride && a.vertexBuffer.count % 3)
+		return false;
+	
+	if (!a.vertexRenderState.matches(b.vertexRenderState) || !a.attributeRenderState.matches(b.attributeRenderState) || !a.fragmentRenderState.matches(b.fragmentRenderState))
+		return false;
+	
+	if (a.vertexBuffer.stride != b.vertexBuffer.stride || a.attributeBuffer.stride != b.attributeBuffer.stride)
+		return false;
+	
+	if (a.indexBuffer.stride && a.vertexBuffer.data == b.vertexBuffer.data && a.vertexBuffer.count == b.vertexBuffer.count &&
+		a.attributeBuffer.data == b.attributeBuffer.data && a.attributeBuffer.count == b.attributeBuffer.count) {
+		bBase = aBase;
+		return true;
+	}
+	
+	if (static_cast<char*>(a.vertexBuffer.data) + a.vertexBuffer.stride*a.vertexBuffer.count != b.vertexBuffer.data)
+		return false;
+	
+	if ((a.attributeBuffer.data || b.attributeBuffer.data) && (a.attributeBuffer.count != a.vertexBuffer.count ||
+		static_cast<char*>(a.attributeBuffer.data) + a.attributeBuffer.stride*a.attributeBuffer.count != b.attributeBuffer.data))
+		return false;
+	
+	bBase = aBase + a.vertexBuffer.count;
+	return true;
+}
+
+template<class T>
+static void rebaseIndices(const void* indices, unsigned count, unsigned base, unsigned* output) {
+	for (unsigned i = 0; i < count; ++i)
+		output[i] = static_cast<const T*>(indices)[i] + base;
+}
+
+// Consecutive draw calls with the same state are drawn as one, which saves tasks and allocations for small draw calls.
+void Renderer::mergeDrawCalls() {
+	size_t count = 0;
+	
+	for (size_t first = 0; first < drawCalls.size();) {
+		size_t last = first;
+		unsigned base = 0;
+		unsigned long long triangleCount = drawCalls[first].triangleCount();
+		bool rebase = false;
+		
+		while (last+1 < drawCalls.size()) {
+			const DrawCall& a = drawCalls[last];
+			const DrawCall& b = drawCalls[last+1];
+			unsigned nextBase;
+			
+			if (!mergeVertexBase(a, b, base, nextBase) || triangleCount + b.triangleCount() > maxDrawCallTriangles)
+				break;
+			
+			// Indices are copied unless they follow each other in memory and need no rebasing. The copies
+			// are made every frame, so the merge costs a pass over the indices and adjacency of the draw calls.
+			if (nextBase || a.indexBuffer.stride != b.indexBuffer.stride ||
+				static_cast<char*>(a.indexBuffer.data) + a.indexBuffer.stride*a.indexBuffer.count != b.indexBuffer.data)
+				rebase = true;
+			
+			base = nextBase;
+			triangleCount += b.triangleCount();
+			++last;
+		}
+		
+		DrawCall m = drawCalls[first];
+		
+		if (last != first) {
+			m.vertexBuffer.count = base + drawCalls[last].vertexBuffer.count;
+			
+			if (m.attributeBuffer.data)
+				m.attributeBuffer.count = base + drawCalls[last].attributeBuffer.count;
+			
+			if (m.indexBuffer.stride) {
+				unsigned indexCount = (unsigned)triangleCount*3;
+				unsigned* indices = rebase ? static_cast<unsigned*>(poolAllocator.allocate(sizeof(unsigned)*indexCount)) : 0;
+				unsigned* adjacency = m.adjacency ? static_cast<unsigned*>(poolAllocator.allocate(sizeof(unsigned)*indexCount)) : 0;
+				unsigned offset = 0;
+				
+				for (size_t i = first, partBase = 0; i <= last; ++i) {
+					const DrawCall& d = drawCalls[i];
+					
+					if (i != first && d.vertexBuffer.data != drawCalls[i-1].vertexBuffer.data)
+						partBase += drawCalls[i-1].vertexBuffer.count;
+					
+					if (indices) {
+						if (d.indexBuffer.stride == 1)
+							rebaseIndices<unsigned char>(d.indexBuffer.data, d.indexBuffer.count, (unsigned)partBase, indices + offset);
+						else if (d.indexBuffer.stride == 2)
+							rebaseIndices<unsigned short>(d.indexBuffer.data, d.indexBuffer.count, (unsigned)partBase, indices + offset);
+						else
+							rebaseIndices<unsigned>(d.indexBuffer.data, d.indexBuffer.count, (unsigned)partBase, indices + offset);
+					}
+					
+					// Adjacency refers to triangles of the part.
+					for (unsigned j = 0; adjacency && j < d.indexBuffer.count; ++j)
+						adjacency[offset + j] = d.adjacency[j] == 0xffffffff ? 0xffffffff : d.adjacency[j] + offset/3;
+					
+					offset += d.indexBuffer.count;
+				}
+				
+				if (indices) {
+					m.indexBuffer.data = indices;
+					m.indexBuffer.stride = 4;
+				}
+				
+				m.indexBuffer.count = indexCount;
+				m.adjacency = adjacency;
+			}
+		}
+		
+		drawCalls[count++] = m;
+		first = last+1;
+	}
+	
+	drawCalls.resize(count);
+}
+
+// Draw calls are batched so that each front-end stage is one task, as long as the work of a batch fits in a task.
+void Renderer::buildDrawCallBatches() {
+	static const unsigned long long maxBatchSize = 0x80000000;
+	
+	for (size_t first = 0; first < drawCalls.size();) {
+		size_t last = first;
+		unsigned long long vertexCount = 0;
+		unsigned long long triangleCount = 0;
+		
+		for (; last < drawCalls.size(); ++last) {
+			const DrawCall& d = drawCalls[last];
+			unsigned count = fusedVertexShading && !d.instanceBuffer.data ? 0 : DrawCallBatch::paddedCount(d.vertexCount());
+			unsigned triangles = DrawCallBatch::paddedCount(d.triangleCount());
+			
+			if (last != first && (vertexCount + count > maxBatchSize || triangleCount + triangles > maxBatchSize))
+				break;
+			
+			vertexCount += count;
+			triangleCount += triangles;
+		}
+		
+		DrawCallBatch batch;
+		batch.drawCalls = &drawCalls[first];
+		batch.drawCallCount = (unsigned)(last - first);
+		batch.vertexStarts = static_cast<unsigned*>(poolAllocator.allocate(sizeof(unsigned)*(batch.drawCallCount+1)));
+		batch.triangleStarts = static_cast<unsigned*>(poolAllocator.allocate(sizeof(unsigned)*(batch.drawCallCount+1)));
+		batch.task = static_cast<ThreadPoolTask*>(poolAllocator.allocate(64));
+		batch.vertexStarts[0] = 0;
+		batch.triangleStarts[0] = 0;
+		
+		// With fused vertex shading only instanced draw calls are shaded up front.
+		for (unsigned i = 0; i < batch.drawCallCount; ++i) {
+			const DrawCall& d = batch.drawCalls[i];
+			unsigned count = fusedVertexShading && !d.instanceBuffer.data ? 0 : d.vertexCount();
+			
+			batch.vertexStarts[i+1] = batch.vertexStarts[i] + DrawCallBatch::paddedCount(count);
+			batch.triangleStarts[i+1] = batch.triangleStarts[i] + DrawCallBatch::paddedCount(d.triangleCount());
+		}
+		
+		drawCallBatches.push_back(batch);
+		first = last;
+	}
+}
+
+// Maps vertex shader output through the view to region clip space. Vertex shading is done once for all views and regions.
+class RegionTransformTask : public ThreadPoolTask {
 private:
 	Renderer& r;
-	DrawCall& d;
+	DrawCallBatch& batch;
 	
 public:
-	VertexShadeTask(Renderer& r, DrawCall& d) : r(r), d(d) {
+	RegionTransformTask(Renderer& r, DrawCallBatch& batch) : r(r), batch(batch) {
 	}
 	
-	virtual void run(unsigned start, unsigned end, unsigned thread) {
+	virtual void run(unsigned start, unsigned end, unsigned) {
+		float width = (float)(int)r.frameBufferWidth;
+		float height = (float)(int)r.frameBufferHeight;
+		float regionWidth = (float)(int)r.regionWidth;
+		float regionHeight = (float)(int)r.regionHeight;
+		
+		float4x4 region(float4(width/regionWidth, 0.0f, 0.0f, 0.0f),
+						float4(0.0f, height/regionHeight, 0.0f, 0.0f),
+						float4(0.0f, 0.0f, 1.0f, 0.0f),
+						float4((width - (float)(int)(2*r.regionX) - regionWidth)/regionWidth,
+							   (height - (float)(int)(2*r.regionY) - regionHeight)/regionHeight, 0.0f, 1.0f));
+		
+		float4x4 m = region * r.viewTransform;
+		__m128 c0 = _mm_loadu_ps(&m.c0.x);
+		__m128 c1 = _mm_loadu_ps(&m.c1.x);
+		__m128 c2 = _mm_loadu_ps(&m.c2.x);
+		__m128 c3 = _mm_loadu_ps(&m.c3.x);
+		
+		for (unsigned j = batch.drawCallAt(batch.vertexStarts, start); start < end; ++j) {
+			const DrawCall& d = batch.drawCalls[j];
+			unsigned first = batch.vertexStarts[j];
+			unsigned last = std::min(end, batch.vertexStarts[j+1]);
+			unsigned count = std::min(last - first, d.vertexCount());
+			
+			const float4* __restrict input = d.frameShadedPositions;
+			float4* __restrict output = d.shadedPositions;
+			
+			for (unsigned i = start - first; i < count; ++i) {
+				__m128 p = _mm_load_ps(&input[i].x);
+				__m128 x = _mm_mul_ps(c0, _mm_shuffle_ps(p, p, _MM_SHUFFLE(0, 0, 0, 0)));
+				__m128 y = _mm_mul_ps(c1, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+				__m128 z = _mm_mul_ps(c2, _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2)));
+				__m128 w = _mm_mul_ps(c3, _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 3, 3)));
+				_mm_store_ps(&output[i].x, _mm_add_ps(_mm_add_ps(x, y), _mm_add_ps(z, w)));
+			}
+			
+			start = last;
+		}
+	}
+	
+	virtual void finished() {
+		setupDrawCallTriangles(r, batch);
+	}
+};
+
+static void transformDrawCallsToRegion(Renderer& r, DrawCallBatch& batch) {
+	RegionTransformTask* t = new (batch.task) RegionTransformTask(r, batch);
+	r.getThreadPool().startTask(t, batch.vertexCount(), 1024, true);
+}
+
+static void shadeVertices(DrawCall& d, unsigned start, unsigned end) {
+	float4* output = d.frameShadedPositions ? d.frameShadedPositions : d.shadedPositions;
+	
+	if (!d.instanceBuffer.data) {
 		d.vertexRenderState.executeShader(static_cast<char*>(d.vertexBuffer.data) + d.vertexBuffer.stride*start,
-										  d.shadedPositions + start, end-start);
+										  output + start, end-start);
+		return;
+	}
+	
+	// Split the range at instance boundaries.
+	unsigned count = d.vertexBuffer.count;
+	
+	while (start < end) {
+		unsigned instance = start / count;
+		unsigned first = start - instance*count;
+		unsigned n = std::min(end - start, count - first);
+		
+		const char* input = static_cast<char*>(d.vertexBuffer.data) + d.vertexBuffer.stride*first;
+		const char* uniforms = static_cast<char*>(d.instanceBuffer.data) + d.instanceBuffer.stride*instance;
+		
+		// The shader stores whole SIMD widths. Instances start off SIMD boundaries, so stores that would reach past the work item go through a temporary.
+		unsigned tail = start + DrawCallBatch::paddedCount(n) > end && end != d.vertexCount() ? n % simd_float::width : 0;
+		
+		d.vertexRenderState.executeShader(input, output + start, n - tail, uniforms);
+		
+		if (tail) {
+			SRAST_SIMD_ALIGNED float4 tailOutput[simd_float::width];
+			d.vertexRenderState.executeShader(input + d.vertexBuffer.stride*(n - tail), tailOutput, tail, uniforms);
+			std::copy(tailOutput, tailOutput + tail, output + start + n - tail);
+		}
+		
+		start += n;
+	}
+}
+
+class VertexShadeTask : public ThreadPoolTask {
+private:
+	Renderer& r;
+	DrawCallBatch& batch;
+	
+public:
+	VertexShadeTask(Renderer& r, DrawCallBatch& batch) : r(r), batch(batch) {
+	}
+	
+	virtual void run(unsigned start, unsigned end, unsigned) {
+		for (unsigned i = batch.drawCallAt(batch.vertexStarts, start); start < end; ++i) {
+			unsigned first = batch.vertexStarts[i];
+			unsigned last = std::min(end, batch.vertexStarts[i+1]);
+			unsigned count = std::min(last - first, batch.drawCalls[i].vertexCount());
+			
+			if (start - first >= count) {
+				start = last;
+				continue;
+			}
+			
+			shadeVertices(batch.drawCalls[i], start - first, count);
+			start = last;
+		}
 	}
 	
 	virtual void finished() {
-		setupDrawCallTriangles(r, d);
+		if (batch.drawCalls[0].frameShadedPositions)
+			transformDrawCallsToRegion(r, batch);
+		else
+			setupDrawCallTriangles(r, batch);
 	}
 };
 
 void Renderer::beginFrontEndShadeAndHimRast() {
-	frameBufferSizeLog2 = 0;
+	bool regions = regionCountX*regionCountY > 1 || !views.empty();
 	
-	while (frameBufferWidth >> frameBufferSizeLog2 && frameBufferHeight >> frameBufferSizeLog2)
-		frameBufferSizeLog2++;
+	// Regions and views reuse the shaded vertices, so they are always shaded up front.
+	if (regions)
+		fusedVertexShading = false;
+	
+	if (!views.empty())
+		setView(0);
+	
+	mergeDrawCalls();
+	
+	// Stamps only need clearing when they wrap. Attribute states keep the stamp in 8 bits.
+	if (++stateStamp == 0x100) {
+		stateStamp = 1;
+		std::fill(vertexStates.begin(), vertexStates.end(), 0);
+		std::fill(attributeStates.begin(), attributeStates.end(), 0);
+	}
+	
+	size_t vertexStateCount = 0;
+	size_t attributeStateCount = 0;
+	vertexCacheStride = 0;
 	
 	for (size_t i = 0; i < drawCalls.size(); ++i) {
+		const DrawCall& d = drawCalls[i];
+		
+		if (fusedVertexShading && !d.instanceBuffer.data) {
+			vertexStateCount += d.vertexBuffer.count;
+			vertexCacheStride = std::max(vertexCacheStride, d.vertexBuffer.stride);
+		}
+		
+		if (!depthOnly)
+			attributeStateCount += d.attributeBuffer.count;
+	}
+	
+	if (vertexStates.size() < vertexStateCount)
+		vertexStates.resize(vertexStateCount);
+	
+	if (attributeStates.size() < attributeStateCount)
+		attributeStates.resize(attributeStateCount);
+	
+	// Vertex caches are allocated by each thread on first use.
+	vertexCaches = static_cast<void**>(poolAllocator.allocate(sizeof(void*)*threadPool.getThreadCount()));
+	std::memset(vertexCaches, 0, sizeof(void*)*threadPool.getThreadCount());
+	
+	for (size_t i = 0, vertexBase = 0, attributeBase = 0; i < drawCalls.size(); ++i) {
 		DrawCall& d = drawCalls[i];
 		
-		unsigned count = d.vertexBuffer.count;
-		unsigned triangleCount = d.indexBuffer.stride ? d.indexBuffer.count/3 : d.vertexBuffer.count/3;
+		unsigned count = d.vertexCount();
+		unsigned triangleCount = d.triangleCount();
 
 		d.shadedPositions = static_cast<float4*>(poolAllocator.allocate(sizeof(float4)*(count+32)));
-		d.edges = static_cast<float4*>(poolAllocator.allocate(sizeof(float4)*(triangleCount*4+32)));
-		d.highpEdgeZ0 = static_cast<double*>(poolAllocator.allocate(sizeof(double)*(triangleCount+32)));
-		d.highpEdgeZ1 = static_cast<double*>(poolAllocator.allocate(sizeof(double)*(triangleCount+32)));
-		d.highpEdgeZ2 = static_cast<double*>(poolAllocator.allocate(sizeof(double)*(triangleCount+32)));
+		d.frameShadedPositions = regions ? static_cast<float4*>(poolAllocator.allocate(sizeof(float4)*(count+32))) : 0;
+		d.edges = static_cast<TriangleEdges*>(poolAllocator.allocate(sizeof(TriangleEdges)*(triangleCount+32)));
+		d.shadedPositionStates = 0;
+		
+		if (fusedVertexShading && !d.instanceBuffer.data && d.vertexBuffer.count) {
+			d.shadedPositionStates = &vertexStates[0] + vertexBase;
+			vertexBase += d.vertexBuffer.count;
+		}
+		
+		if (!depthOnly) {
+			d.shadedAttributes = static_cast<float*>(poolAllocator.allocate(d.attributeRenderState.getShader()->outputStride()*d.attributeBuffer.count));
+			d.shadedAttributeStates = d.attributeBuffer.count ? &attributeStates[0] + attributeBase : 0;
+			attributeBase += d.attributeBuffer.count;
+		}
+		
 		d.flags = static_cast<unsigned char*>(poolAllocator.allocate(triangleCount + 32));
-		d.task = static_cast<ThreadPoolTask*>(poolAllocator.allocate(64));
+	}
+	
+	buildDrawCallBatches();
+	
+	for (size_t i = 0; i < drawCallBatches.size(); ++i) {
+		DrawCallBatch& batch = drawCallBatches[i];
 		
-		VertexShadeTask* t = new (d.task) VertexShadeTask(*this, d);
-		threadPool.startTask(t, count, 1024, true);
+		if (batch.vertexCount()) {
+			VertexShadeTask* t = new (batch.task) VertexShadeTask(*this, batch);
+			threadPool.startTask(t, batch.vertexCount(), 1024, true);
+		}
+		else {
+			setupDrawCallTriangles(*this, batch);
+		}
 	}
 
+	beginRegion();
+}
+
+void Renderer::beginRegion() {
+	frameBufferSizeLog2 = 0;
+	
+	while (regionWidth >> frameBufferSizeLog2 && regionHeight >> frameBufferSizeLog2)
+		frameBufferSizeLog2++;
+	
 	if (frameNumber == 0xffffffff) {
 		// Clear all bins. Expensive but happens less than once each month at a rate of 1000 fps.
 		frameNumber = 0;
@@ -190,19 +741,68 @@ void Renderer::beginFrontEndShadeAndHimRast() {
 
 void Renderer::beginFrontEndBin() {
 	threadPool.barrier();
-	
+	binRegion();
+}
+
+void Renderer::binRegion() {
 	if (dense)
 		importanceMap.fill();
 	
 	importanceMap.build(threadPool);
 
-	for (size_t i = 0; i < drawCalls.size(); ++i)
-		binDrawCall(drawCalls[i]);
+	for (size_t i = 0; i < drawCallBatches.size(); ++i)
+		binDrawCalls(drawCallBatches[i]);
 }
 
 void Renderer::beginBackEnd() {
 	threadPool.barrier();
+	
+	// Resolve contexts are allocated by each thread on first use, sized for the draw calls of the frame.
+	resolveContexts = static_cast<void**>(poolAllocator.allocate(sizeof(void*)*threadPool.getThreadCount()));
+	std::memset(resolveContexts, 0, sizeof(void*)*threadPool.getThreadCount());
+	resolveInAttributeStride = 0;
+	resolveOutAttributeStride = 0;
+	resolveBlended = false;
+	resolveOit = false;
+	
+	for (size_t i = 0; i < drawCalls.size() && !depthOnly; ++i) {
+		const DrawCall& d = drawCalls[i];
+		unsigned attributeStride = d.attributeRenderState.getShader()->outputStride();
+		
+		// Each fragment brings up to three vertices to shade and one set of interpolated attributes.
+		resolveInAttributeStride = std::max(resolveInAttributeStride, std::max(3*d.attributeBuffer.stride, attributeStride));
+		resolveOutAttributeStride = std::max(resolveOutAttributeStride, std::max(3*attributeStride, d.fragmentRenderState.getShader()->outputStride()));
+		
+		if (!d.fragmentRenderState.isOpaque()) {
+			bool oit = orderIndependentTransparency && !d.fragmentRenderState.getDepthWrite();
+			resolveOit |= oit;
+			resolveBlended |= !oit;
+		}
+	}
+	
 	resolveTiles();
+	
+	// Remaining regions and views are rendered to completion here, reusing the shaded vertices.
+	unsigned regionCount = regionCountX*regionCountY;
+	unsigned passCount = regionCount*std::max(1u, (unsigned)views.size());
+	
+	for (unsigned i = 1; i < passCount; ++i) {
+		threadPool.barrier();
+		
+		if (i % regionCount == 0)
+			setView(i / regionCount);
+		
+		setRegion(i % regionCount);
+		
+		for (size_t j = 0; j < drawCallBatches.size(); ++j)
+			transformDrawCallsToRegion(*this, drawCallBatches[j]);
+		
+		beginRegion();
+		threadPool.barrier();
+		binRegion();
+		threadPool.barrier();
+		resolveTiles();
+	}
 }
 
 void Renderer::finish() {
@@ -216,12 +816,24 @@ void Renderer::reset() {
 	
 	dense = false;
 	transparentImportance = false;
-	clearColor = 0;
+	orderIndependentTransparency = false;
+	fusedVertexShading = false;
+	depthOnly = false;
+	conservativeCoverage = false;
+	setClearColor(0);
 	frameBuffer = 0;
-	rasterizeDrawCallToHim = 0;
+	depthBuffer = 0;
+	depthBufferFormat = DEPTHBUFFERFORMAT_Z32F;
+	depthBufferPitch = 0;
+	views.resize(0);
+	viewTransform.loadIdentity();
+	setSampleCount(16);
+	rasterizeDrawCallsToHim = 0;
+	maxRegionSize = maxRegionSizeLimit;
 
 	currentDrawCall = DrawCall();
 	drawCalls.resize(0);
+	drawCallBatches.resize(0);
 }
 
 Renderer::~Renderer() {
@@ -292,53 +904,157 @@ unsigned* Renderer::generateAdjacencyBuffer(const void* indices, unsigned stride
 class BinTask : public ThreadPoolTask {
 private:
 	Renderer& r;
-	DrawCall& drawCall;
+	DrawCallBatch& batch;
 
 public:
-	BinTask(Renderer& r, DrawCall& drawCall) : r(r), drawCall(drawCall) {
+	BinTask(Renderer& r, DrawCallBatch& batch) : r(r), batch(batch) {
 	}
 	
 	virtual void run(unsigned start, unsigned end, unsigned thread) {
-		binDrawCall(r, drawCall, start, end, r.frameBufferSizeLog2, thread);
+		for (unsigned i = batch.drawCallAt(batch.triangleStarts, start); start < end; ++i) {
+			unsigned first = batch.triangleStarts[i];
+			unsigned last = std::min(end, batch.triangleStarts[i+1]);
+			unsigned count = std::min(last - first, batch.drawCalls[i].triangleCount());
+			
+			if (start - first >= count) {
+				start = last;
+				continue;
+			}
+			
+			binDrawCall(r, batch.drawCalls[i], start - first, count, r.frameBufferSizeLog2, thread);
+			start = last;
+		}
 	}
 };
 
-void Renderer::binDrawCall(DrawCall& drawCall) {
-	BinTask* t = new (drawCall.task) BinTask(*this, drawCall);
-	unsigned triangleCount = drawCall.indexBuffer.stride ? drawCall.indexBuffer.count/3 : drawCall.vertexBuffer.count/3;
-	
-	threadPool.startTask(t, triangleCount, 1024);
+void Renderer::binDrawCalls(DrawCallBatch& batch) {
+	BinTask* t = new (batch.task) BinTask(*this, batch);
+	threadPool.startTask(t, batch.triangleCount(), 1024);
 }
 
 class ResolveTask : public ThreadPoolTask {
 private:
 	Renderer& r;
-	unsigned tileWidth;
-	unsigned tileHeight;
+	const unsigned* tiles;
 	
 public:
-	ResolveTask(Renderer& r, unsigned tileWidth, unsigned tileHeight) : r(r), tileWidth(tileWidth), tileHeight(tileHeight) {
+	ResolveTask(Renderer& r, const unsigned* tiles) : r(r), tiles(tiles) {
 	}
 	
 	virtual void run(unsigned start, unsigned end, unsigned thread) {
-		for (unsigned i = start; i < end; ++i) {
-			unsigned x = (i % tileWidth) << tileSizeLog2;
-			unsigned y = (i / tileWidth) << tileSizeLog2;
-			resolveTile(r, x, y, thread);
-		}
+		for (unsigned i = start; i < end; ++i)
+			resolveTile(r, tiles[i] & 0xffff, tiles[i] >> 16, thread);
 	}
+};
+
+static unsigned compactBits(unsigned x) {
+	x &= 0x55555555;
+	x = (x | (x >> 1)) & 0x33333333;
+	x = (x | (x >> 2)) & 0x0f0f0f0f;
+	x = (x | (x >> 4)) & 0x00ff00ff;
+	x = (x | (x >> 8)) & 0x0000ffff;
+	return x;
+}
 
-	virtual void finish() {
-		delete this;
+static unsigned costClass(unsigned entries) {
+	unsigned c = 0;
+	
+	while (entries) {
+		++c;
+		entries >>= 1;
+	}
+	return c;
+}
+
+class ClearTask : public ThreadPoolTask {
+private:
+	Renderer& r;
+	const unsigned char* tileClass;
+	
+public:
+	ClearTask(Renderer& r, const unsigned char* tileClass) : r(r), tileClass(tileClass) {
+	}
+	
+	virtual void run(unsigned start, unsigned end, unsigned) {
+		for (unsigned i = start; i < end; ++i)
+			clearEmptyTiles(r, tileClass, i << tileSizeLog2);
 	}
 };
 
+// Classifies tiles by the log2 of their bin entry count. Class zero tiles are empty.
+static unsigned char* classifyTiles(const BinListArray& binListArray, PoolAllocator& poolAllocator, unsigned tileCount, unsigned frameNumber) {
+	unsigned char* tileClass = static_cast<unsigned char*>(poolAllocator.allocate(tileCount));
+	
+	for (unsigned i = 0; i < tileCount; ++i)
+		tileClass[i] = (unsigned char)costClass(binListArray.entries(i, frameNumber));
+	
+	return tileClass;
+}
+
+/*
+ Orders non-empty tiles by class, heaviest first, so the last work items handed out are cheap and
+ threads finish together. Within a class tiles are in Morton order, traversed in square blocks so
+ non-square regions don't waste iterations.
+*/
+static unsigned* buildResolveOrder(const unsigned char* tileClass, PoolAllocator& poolAllocator, unsigned tileWidth, unsigned tileHeight, unsigned& tileCount) {
+	static const unsigned classCount = 33;
+	unsigned classStart[classCount] = {};
+	
+	for (unsigned i = 0; i < tileWidth*tileHeight; ++i)
+		++classStart[tileClass[i]];
+	
+	unsigned offset = 0;
+	
+	for (unsigned c = classCount; c-- > 1;) {
+		unsigned count = classStart[c];
+		classStart[c] = offset;
+		offset += count;
+	}
+	
+	tileCount = offset;
+	unsigned* order = static_cast<unsigned*>(poolAllocator.allocate(sizeof(unsigned)*tileCount));
+	
+	unsigned blockSize = 1;
+	
+	while (blockSize*2 <= std::min(tileWidth, tileHeight))
+		blockSize *= 2;
+	
+	for (unsigned by = 0; by < tileHeight; by += blockSize) {
+		for (unsigned bx = 0; bx < tileWidth; bx += blockSize) {
+			for (unsigned m = 0; m < blockSize*blockSize; ++m) {
+				unsigned x = bx + compactBits(m);
+				unsigned y = by + compactBits(m >> 1);
+				
+				if (x >= tileWidth || y >= tileHeight)
+					continue;
+				
+				unsigned c = tileClass[y*tileWidth + x];
+				
+				if (c)
+					order[classStart[c]++] = (x << tileSizeLog2) | (y << (16 + tileSizeLog2));
+			}
+		}
+	}
+	return order;
+}
+
 void Renderer::resolveTiles() {
-	unsigned tileWidth = (frameBufferWidth + (1 << tileSizeLog2)-1) >> tileSizeLog2;
-	unsigned tileHeight = (frameBufferHeight + (1 << tileSizeLog2)-1) >> tileSizeLog2;
+	unsigned tileWidth = binListArray.getWidth();
+	unsigned tileHeight = binListArray.getHeight();
+	
+	unsigned char* tileClass = classifyTiles(binListArray, poolAllocator, tileWidth*tileHeight, frameNumber);
+	
+	unsigned tileCount;
+	unsigned* order = buildResolveOrder(tileClass, poolAllocator, tileWidth, tileHeight, tileCount);
 	
-	ResolveTask* t = new ResolveTask(*this, tileWidth, tileHeight);
-	threadPool.startTask(t, tileWidth*tileHeight, 8, true);
+	// Empty tiles only need the clear color, which is written a row of tiles at a time.
+	ClearTask* c = new (poolAllocator.allocate(sizeof(ClearTask))) ClearTask(*this, tileClass);
+	threadPool.startTask(c, tileHeight, 4);
+	
+	if (tileCount) {
+		ResolveTask* t = new (poolAllocator.allocate(sizeof(ResolveTask))) ResolveTask(*this, order);
+		threadPool.startTask(t, tileCount, 4);
+	}
 }
 
 void Renderer::setupShaders(DrawCall& drawCall) {
@@ -346,8 +1062,11 @@ void Renderer::setupShaders(DrawCall& drawCall) {
 		RenderState& state = i == SHADERKIND_ATTR ? drawCall.attributeRenderState :
 		(i == SHADERKIND_VERT ? static_cast<RenderState&>(drawCall.vertexRenderState) : static_cast<RenderState&>(drawCall.fragmentRenderState));
 
-		state.setShader(currentShader[i], currentUniforms[i]);
+		state.setShader(currentShader[i], currentUniforms[i], currentUniformSize[i]);
 	}
+	
+	if (drawCall.fragmentRenderState.getShader() && drawCall.fragmentRenderState.getShader()->outputStride() != frameBufferPixelSize(frameBufferFormat))
+		throw std::runtime_error("fragment shader output does not match frame buffer format");
 }
 
 }
@@ -29,10 +29,36 @@ enum SHADERKIND {
 
 enum FRAMEBUFFERFORMAT {
 	FRAMEBUFFERFORMAT_RGBA8 = 0,
+	FRAMEBUFFERFORMAT_RGBA16F, // Half floats, premultiplied alpha.
+	FRAMEBUFFERFORMAT_RGBA32F, // Floats, 16-byte aligned, premultiplied alpha.
+};
+
+enum DEPTHBUFFERFORMAT {
+	DEPTHBUFFERFORMAT_Z32F = 0, // Nearest sample depth.
+	DEPTHBUFFERFORMAT_Z32F_RANGE, // Nearest and farthest sample depth.
+};
+
+enum COVERAGEMODE {
+	COVERAGEMODE_CENTER = 0,
+	COVERAGEMODE_CONSERVATIVE, // Any pixel touched by a triangle.
+};
+
+static const unsigned maxSamplesPerPixel = 16;
+
+// Sample locations within a pixel. Patterns with fewer samples are repeated to fill the arrays.
+struct SRAST_ALIGNED(64) SamplePattern {
+	float x[maxSamplesPerPixel];
+	float y[maxSamplesPerPixel];
+};
+
+// A view maps vertex shader output to clip space and renders into its own buffers.
+struct RenderView {
+	float4x4 transform;
+	void* frameBuffer;
+	void* depthBuffer;
 };
 
 class Renderer {
-	template<class T>
 	friend class TriangleSetupTask;
 	
 	friend class BinTask;
@@ -41,6 +67,12 @@ class Renderer {
 	friend void binDrawCallInMode(Renderer& r, DrawCall& drawCall, unsigned start, unsigned end, int maxLevel, unsigned thread);
 
 	friend void resolveTile(Renderer& r, unsigned x, unsigned y, unsigned thread);
+	friend void clearEmptyTiles(Renderer& r, const unsigned char* tileClass, unsigned ty);
+	
+	template<class Samples, class Color>
+	friend void resolveTileInMode(Renderer& r, unsigned x, unsigned y, unsigned thread);
+	
+	friend class RegionTransformTask;
 	
 private:
 	ThreadPool threadPool;
@@ -51,26 +83,61 @@ private:
 	CompositeBinListArray compositeBinListArray;
 	ThreadLocalAllocatorArray localAllocators;
 	
+	void** resolveContexts;
+	unsigned resolveInAttributeStride, resolveOutAttributeStride; // Per shaded fragment.
+	bool resolveBlended, resolveOit;
+	
+	void** vertexCaches;
+	unsigned vertexCacheStride;
+	
+	// Per-vertex states are kept across frames and stamped with the frame, so they don't need clearing each frame.
+	std::vector<unsigned> vertexStates;
+	std::vector<unsigned> attributeStates;
+	unsigned stateStamp;
+	
 	bool dense;
 	bool transparentImportance;
+	bool orderIndependentTransparency;
+	bool fusedVertexShading;
+	bool depthOnly;
+	bool conservativeCoverage;
 	
 	unsigned clearColor;
+	float4 clearColorFloat;
 	unsigned frameNumber;
+	
+	unsigned samplesPerPixelLog2;
+	const SamplePattern* samplePattern;
 
 	void* frameBuffer;
 	FRAMEBUFFERFORMAT frameBufferFormat;
+	
+	void* depthBuffer;
+	DEPTHBUFFERFORMAT depthBufferFormat;
+	unsigned depthBufferPitch;
 	unsigned frameBufferWidth, frameBufferHeight, frameBufferPitch;
 	unsigned frameBufferSizeLog2;
 	
+	// Frame buffers larger than maxRegionSize are rendered as a grid of regions.
+	unsigned maxRegionSize;
+	unsigned regionCountX, regionCountY, regionStrideX, regionStrideY;
+	unsigned regionX, regionY, regionWidth, regionHeight;
+	
+	// Views share the shaded vertices and are rendered one after another, reusing the importance map and bins.
+	std::vector<RenderView> views;
+	float4x4 viewTransform;
+	
 	DrawCall currentDrawCall;
 	
 	Shader* currentShader[3];
 	const void* currentUniforms[3];
+	unsigned currentUniformSize[3];
 
 	std::map<void*, unsigned*> adjacencyBuffers;
 	std::vector<DrawCall> drawCalls;
+	std::vector<DrawCallBatch> drawCallBatches;
 	
-	void (*rasterizeDrawCallToHim)(Renderer& r, DrawCall& drawCall);
+	void (*rasterizeDrawCallsToHim)(Renderer& r, DrawCallBatch& batch);
 
 public:
 	Renderer();
@@ -95,6 +162,14 @@ public:
 		return frameBufferHeight;
 	}
 	
+	unsigned getRegionWidth() const {
+		return regionWidth;
+	}
+	
+	unsigned getRegionHeight() const {
+		return regionHeight;
+	}
+	
 	unsigned getFrameBufferPitch() const {
 		return frameBufferPitch;
 	}
@@ -107,20 +182,42 @@ public:
 		return transparentImportance;
 	}
 	
+	bool hasConservativeCoverage() const {
+		return conservativeCoverage;
+	}
+	
 	VertexRenderState& getVertexRenderState();
 	
 	FragmentRenderState& getFragmentRenderState();
 	
 	void setClearColor(unsigned color);
+	
+	void setClearColor(const float4& color); // Unclamped for float frame buffers.
+	
+	void setSampleCount(unsigned count); // 1, 4, 8 or 16 samples per pixel using a built-in pattern.
+	
+	void setSamplePattern(unsigned count, const float* locations); // x, y pairs in [0, 1), snapped to 1/32 pixels.
 
 	void forceDense();
 	
 	void forceTransparentImportance();
 	
-	void setupHimRasterization(void (*rasterizeDrawCallToHim)(Renderer& r, DrawCall& drawCall));
+	void forceOrderIndependentTransparency(); // Composite blended draw calls without depth write in depth order per pixel.
+	
+	void forceFusedVertexShading(); // Shade vertices on demand during triangle setup. Ignored when rendering in regions or views, which shade vertices up front.
+	
+	void forceDepthOnly(COVERAGEMODE coverage = COVERAGEMODE_CENTER); // Only write the depth buffer, one sample per pixel. No attribute or fragment shaders are needed and the frame buffer may be null.
+	
+	void forceRegionSize(unsigned size); // Call before bindFrameBuffer.
+	
+	void setupHimRasterization(void (*rasterizeDrawCallsToHim)(Renderer& r, DrawCallBatch& batch));
 	
 	void bindFrameBuffer(FRAMEBUFFERFORMAT format, void* frameBuffer, unsigned width, unsigned height, unsigned pitch);
 	
+	void bindDepthBuffer(DEPTHBUFFERFORMAT format, void* depthBuffer, unsigned pitch); // Optional, same size and orientation as the frame buffer.
+	
+	void addView(const float4x4& transform, void* frameBuffer, void* depthBuffer = 0); // Render the frame once per view with vertices shaded once. Views share the size, format and pitch of the bound buffers.
+	
 	void bindIndexBuffer(void* indexBuffer, unsigned offset, unsigned size, unsigned count);
 	
 	void bindVertexBuffer(void* vertexBuffer, unsigned offset, unsigned stride, unsigned count);
@@ -131,10 +228,13 @@ public:
 	
 	void bindShader(SHADERKIND shaderKind, Shader* shader, const void* uniforms, unsigned uniformSize);
 	
+	// Draw calls throw beyond 2^30-1 triangles each, 2^24-1 draw calls per frame or 2^40-2 triangles per frame.
 	void drawList();
 	
 	void drawIndexed();
 	
+	void drawIndexedInstanced(unsigned instanceCount, void* instanceBuffer, unsigned stride); // Each instance runs the vertex shader with its element of the instance buffer as uniforms.
+	
 	void beginFrontEndShadeAndHimRast();
 
 	void beginFrontEndBin();
@@ -150,11 +250,25 @@ public:
 private:
 	unsigned* generateAdjacencyBuffer(const void* indices, unsigned stride, unsigned count);
 	
-	void binDrawCall(DrawCall& drawCall);
+	void binDrawCalls(DrawCallBatch& batch);
 	
 	void resolveTiles();
 	
+	void setRegion(unsigned region);
+	
+	void setView(unsigned view);
+	
+	void beginRegion();
+	
+	void binRegion();
+	
 	void setupShaders(DrawCall& drawCall);
+	
+	void addDrawCall(DrawCall& drawCall);
+	
+	void mergeDrawCalls();
+	
+	void buildDrawCallBatches();
 };
 
 }
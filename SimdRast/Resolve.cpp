@@ -10,25 +10,21 @@
 #include "SimdMath.h"
 #include "SimdDouble.h"
 #include "ZMode.h"
-#include "QuickSort.h"
+#include "RadixSort.h"
+#include "Atomics.h"
+#include <algorithm>
 
 namespace srast {
 
-SRAST_ALIGNED(64) static const float sampleLocationsX[] = {
-	0.031250f, 0.093750f, 0.156250f, 0.218750f,
-	0.281250f, 0.343750f, 0.406250f, 0.468750f,
-	0.531250f, 0.593750f, 0.656250f, 0.718750f,
-	0.781250f, 0.843750f, 0.906250f, 0.968750f,
+// Samples per pixel. Sample arrays are padded to at least one SIMD register with repeated samples.
+// The padding is never part of a sample mask.
+template<unsigned Log2>
+struct SampleCount {
+	static const unsigned log2 = Log2;
+	static const unsigned count = 1 << Log2;
+	static const unsigned mask = (1 << count)-1;
+	static const unsigned stride = count < 8 ? 8 : count;
 };
-SRAST_ALIGNED(64) static const float sampleLocationsY[] = {
-	0.343750f, 0.843750f, 0.531250f, 0.093750f,
-	0.718750f, 0.468750f, 0.218750f, 0.968750f,
-	0.593750f, 0.281250f, 0.781250f, 0.031250f,
-	0.406250f, 0.906250f, 0.156250f, 0.656250f,
-};
-
-static const unsigned samplesPerPixelLog2 = 4;
-static const unsigned samplesPerPixel = 1 << samplesPerPixelLog2;
 
 #ifdef _WIN32
 inline unsigned __builtin_ctz(unsigned x) {
@@ -38,54 +34,257 @@ inline unsigned __builtin_ctz(unsigned x) {
 }
 #endif
 
-struct PixelSamples {
+/*
+ Color formats. Colors are stored per sample in the frame buffer format and fragment shaders output
+ the same format. Blending is premultiplied alpha, in fixed point for RGBA8 and in float otherwise.
+*/
+struct ColorRgba8 {
+	typedef unsigned Type;
+
+	struct Source {
+		__m128i rgba;
+		__m128i op1;
+	};
+
+	static Type clearColor(unsigned color, const float4&) {
+		return color;
+	}
+
+	static Source source(Type color) {
+		Source s;
+		s.rgba = _mm_cvtepu8_epi16(_mm_cvtsi32_si128(color));
+
+		__m128i alpha = _mm_shufflelo_epi16(s.rgba, _MM_SHUFFLE(3,3,3,3));
+		__m128i invAlpha = _mm_sub_epi16(_mm_set1_epi16(0xff), alpha);
+
+		s.op1 = _mm_unpacklo_epi16(_mm_set1_epi16(0xff), invAlpha);
+		return s;
+	}
+
+	// Blends the four channels of one color. op2 interleaves source and destination channels.
+	static __m128i blendChannels(const Source& s, __m128i op2) {
+		__m128i result = _mm_madd_epi16(s.op1, op2);
+
+		result = _mm_add_epi32(result, _mm_set1_epi32(255/2));
+
+		// r/255 = (r + 1 + (r >> 8)) >> 8, r < 65535
+		return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(result, _mm_set1_epi32(1)), _mm_srli_epi32(result, 8)), 8);
+	}
+
+	static Type blend(const Source& s, Type dest) {
+		__m128i destRgba = _mm_cvtepu8_epi16(_mm_cvtsi32_si128(dest));
+		__m128i result = blendChannels(s, _mm_unpacklo_epi16(s.rgba, destRgba));
+
+		result = _mm_packus_epi32(result, result);
+		result = _mm_packus_epi16(result, result);
+		return _mm_cvtsi128_si32(result);
+	}
+
+	// Blends the given samples, four per register. dst is aligned and padded to a multiple of four samples.
+	static void blend(const Source& s, Type* __restrict dst, unsigned samples) {
+		__m128i source = _mm_unpacklo_epi64(s.rgba, s.rgba);
+		__m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+
+		for (unsigned i = 0; samples >> i; i += 4) {
+			if (!((samples >> i) & 0xf))
+				continue;
+
+			__m128i* p = reinterpret_cast<__m128i*>(dst + i);
+			__m128i dest = _mm_load_si128(p);
+			__m128i dest01 = _mm_unpacklo_epi8(dest, _mm_setzero_si128());
+			__m128i dest23 = _mm_unpackhi_epi8(dest, _mm_setzero_si128());
+
+			__m128i result01 = _mm_packus_epi32(blendChannels(s, _mm_unpacklo_epi16(source, dest01)), blendChannels(s, _mm_unpackhi_epi16(source, dest01)));
+			__m128i result23 = _mm_packus_epi32(blendChannels(s, _mm_unpacklo_epi16(source, dest23)), blendChannels(s, _mm_unpackhi_epi16(source, dest23)));
+
+			__m128i mask = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(samples >> i), bits), bits);
+			_mm_store_si128(p, _mm_blendv_epi8(dest, _mm_packus_epi16(result01, result23), mask));
+		}
+	}
+};
+
+struct Rgba16fFormat {
+	typedef unsigned long long Type;
+
+	static __m128 load(Type color) {
+		return simd_half_to_float(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&color)));
+	}
+
+	static Type store(__m128 color) {
+		Type result;
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(&result), simd_float_to_half(color));
+		return result;
+	}
+};
+
+struct SRAST_ALIGNED(16) PixelRgba32f {
+	float c[4];
+
+	bool operator == (const PixelRgba32f& other) const {
+		__m128i a = _mm_load_si128(reinterpret_cast<const __m128i*>(c));
+		__m128i b = _mm_load_si128(reinterpret_cast<const __m128i*>(other.c));
+		return _mm_movemask_epi8(_mm_cmpeq_epi32(a, b)) == 0xffff;
+	}
+};
+
+struct Rgba32fFormat {
+	typedef PixelRgba32f Type;
+
+	static __m128 load(const Type& color) {
+		return _mm_load_ps(color.c);
+	}
+
+	static Type store(__m128 color) {
+		Type result;
+		_mm_store_ps(result.c, color);
+		return result;
+	}
+};
+
+template<class Format>
+struct ColorFloat : Format {
+	typedef typename Format::Type Type;
+
+	struct Source {
+		__m128 rgba;
+		__m128 invAlpha;
+	};
+
+	static Type clearColor(unsigned, const float4& colorFloat) {
+		return Format::store(_mm_loadu_ps(&colorFloat.x));
+	}
+
+	static Source source(const Type& color) {
+		Source s;
+		s.rgba = Format::load(color);
+		s.invAlpha = _mm_sub_ps(_mm_set1_ps(1.0f), _mm_shuffle_ps(s.rgba, s.rgba, _MM_SHUFFLE(3,3,3,3)));
+		return s;
+	}
+
+	static Type blend(const Source& s, const Type& dest) {
+		return Format::store(_mm_add_ps(s.rgba, _mm_mul_ps(Format::load(dest), s.invAlpha)));
+	}
+
+	// Blends the given samples. Each sample is a register already.
+	static void blend(const Source& s, Type* __restrict dst, unsigned samples) {
+		do {
+			unsigned j = __builtin_ctz(samples);
+			dst[j] = blend(s, dst[j]);
+			samples &= samples-1;
+		}
+		while (samples);
+	}
+};
+
+typedef ColorFloat<Rgba16fFormat> ColorRgba16f;
+typedef ColorFloat<Rgba32fFormat> ColorRgba32f;
+
+/*
+ Colors are kept as up to maxColors colors with disjoint sample masks, which covers most pixels and
+ fits in the first cache line with the rest of the pixel state. Pixels that need more entries spill
+ to per-sample colors in c, which points outside the pixel. colorCount is zero once the colors are
+ per sample.
+*/
+template<class Samples, class Color>
+struct SRAST_SIMD_ALIGNED PixelSamples {
+	static const unsigned maxColors = 4;
+
 	unsigned fragmentCount;
 	unsigned sampleMask;
 	unsigned earlyOut;
 	unsigned isImportant;
 	float zmax;
-	float padding[3];
-	float z[samplesPerPixel];
-	unsigned c[samplesPerPixel];
-	unsigned long long fragments[samplesPerPixel];
+	unsigned colorCount;
+	typename Color::Type* c;
+	typename Color::Type colors[maxColors];
+	unsigned colorMasks[maxColors];
+	SRAST_SIMD_ALIGNED float z[Samples::stride];
+	unsigned long long fragments[Samples::stride]; // Blended draw calls store up to a SIMD width per batch.
 };
 
 struct SRAST_ALIGNED(8) BinnedTriangle {
-	unsigned idx;
+	unsigned idx; // Slot in the chunk, which keeps bin order.
 	unsigned z;
 };
 
-struct ResolveContext {
-	static const unsigned maxTrianglesPerTile = 8*1024;
-	static const unsigned maxFragments = samplesPerPixel << (tileSizeLog2 + tileSizeLog2);
-	static const int maxAttributeSizeInSSE = 8;
-
-	BinnedTriangle triangles[maxTrianglesPerTile];
-
-	unsigned long long fragments[maxFragments + 16]; // Expanded for end marker.
-	float inAttributes[maxAttributeSizeInSSE*maxFragments*4*3];
-	float outAttributes[maxAttributeSizeInSSE*maxFragments*4*3];
+struct ChunkTriangle {
+	unsigned drawCall;
+	unsigned triangle;
+};
 
+template<class Samples, class Color>
+struct ResolveContext {
+	static const unsigned maxTrianglesPerChunk = 2*1024;
+	static const unsigned maxFragments = Samples::count << (tileSizeLog2 + tileSizeLog2);
+	static const unsigned maxBatchFragments = simd_float::width << (tileSizeLog2 + tileSizeLog2);
+	static const unsigned oitLayers = 8;
+	static const unsigned maxOitFragments = oitLayers << (tileSizeLog2 + tileSizeLog2);
+	static const unsigned maxBlendFragments = maxBatchFragments > maxOitFragments ? maxBatchFragments : maxOitFragments;
+	static const unsigned maxShadedFragments = maxFragments > maxBlendFragments ? maxFragments : maxBlendFragments;
+	static const unsigned maxAttributes = maxShadedFragments*3;
+
+	// Per-pixel state and fragments are used by every stage and come first.
+	SRAST_SIMD_ALIGNED PixelSamples<Samples, Color> targetPixelSamples[1 << (tileSizeLog2 + tileSizeLog2)];
+	SRAST_SIMD_ALIGNED float targetPixelsX[1 << (tileSizeLog2 + tileSizeLog2)];
+	SRAST_SIMD_ALIGNED float targetPixelsY[1 << (tileSizeLog2 + tileSizeLog2)];
 	unsigned targetPixels[1 << (tileSizeLog2 + tileSizeLog2)];
-	float targetPixelsX[1 << (tileSizeLog2 + tileSizeLog2)];
-	float targetPixelsY[1 << (tileSizeLog2 + tileSizeLog2)];
-	SRAST_SIMD_ALIGNED PixelSamples targetPixelSamples[1 << (tileSizeLog2 + tileSizeLog2)];
 	unsigned targetPixelCount;
+	unsigned thread;
+	unsigned attributeStamp;
+	const SamplePattern* samplePattern;
 	float tileX;
 	float tileY;
 	float halfWidth;
 	float halfHeight;
+	unsigned blendFragmentCount; // Fragments of the current blended draw call waiting to be shaded.
+	unsigned drawCallCount;
+
+	unsigned long long fragments[maxShadedFragments + 16]; // Expanded for end marker.
+	unsigned long long sortScratch[maxTrianglesPerChunk > maxShadedFragments ? maxTrianglesPerChunk : maxShadedFragments];
+	BinnedTriangle triangles[maxTrianglesPerChunk];
+	ChunkTriangle chunkTriangles[maxTrianglesPerChunk];
+	unsigned attributeRefs[maxAttributes];
+	unsigned attributeSlotVertices[maxAttributes];
+
+	// Order-independent transparency. Each pixel keeps its nearest oitLayers fragments, farther ones go to the tail.
+	unsigned oitCounts[1 << (tileSizeLog2 + tileSizeLog2)];
+	unsigned oitTailCount;
+
+	// The rest is allocated with the context for what the frame needs. See resolveTileInMode.
+	unsigned long long* oitFragments; // maxOitFragments each.
+	unsigned long long* oitTailFragments;
+	typename Color::Type* oitColors;
+	float* oitDepths;
+	float* oitTailDepths;
+	typename Color::Type* spillColors; // Samples::stride per pixel with more colors than fit in the pixel.
+	float* inAttributes;
+	float* outAttributes;
+	unsigned shadedFragments; // Most fragments shaded at once.
 };
 
-#define FRAGCMP_DRAWCALL 0xffff000000000000ull
-#define FRAGCMP_TRIANGLE 0x0000ffffff000000ull
+// Fragment keys hold the frame triangle, which orders fragments by draw call and then triangle. See DrawCall::triangleBase.
+#define FRAGCMP_TRIANGLE 0xffffffffff000000ull
 #define FRAGCMP_PIXEL    0x0000000000ff0000ull
 #define FRAGCMP_SAMPLES  0x000000000000ffffull
 
+// Tiles with fewer than one triangle per this many pixels are resolved with lanes across pixels.
+static const unsigned pixelParallelRatio = 16;
+
+inline unsigned bitCount(unsigned x) {
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	return (((x + (x >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
 inline unsigned long long fragCmp(unsigned long long a, unsigned long long b, unsigned long long flags) {
 	return (a ^ b) & flags;
 }
 
+// Blended draw calls that do not write depth can be composited regardless of submission order.
+inline bool isOrderIndependent(const FragmentRenderState& state) {
+	return !state.isOpaque() && !state.getDepthWrite();
+}
+
 inline int3 triangleIndices(const DrawCall& drawCall, unsigned triangle) {
 	int3 indices;
 	
@@ -116,7 +315,71 @@ inline int3 triangleIndices(const DrawCall& drawCall, unsigned triangle) {
 	return indices;
 }
 
-static unsigned shadeDrawCallFragments(ResolveContext& context, const DrawCall* __restrict drawCalls, unsigned firstFragment, unsigned long long* __restrict fragments) {
+// Finds the draw call of a frame triangle. Empty draw calls share their base with the next one.
+inline unsigned frameTriangleDrawCall(const DrawCall* drawCalls, unsigned drawCallCount, unsigned long long frameTriangle) {
+	unsigned first = 0;
+	
+	while (drawCallCount > 1) {
+		unsigned half = drawCallCount/2;
+		
+		if (drawCalls[first + half].triangleBase <= frameTriangle) {
+			first += half;
+			drawCallCount -= half;
+		}
+		else {
+			drawCallCount = half;
+		}
+	}
+	
+	return first;
+}
+
+// Splits a triangle of an instanced draw call into its instance and the triangle within it.
+inline unsigned triangleInstance(const DrawCall& drawCall, unsigned& triangle) {
+	if (!drawCall.instanceBuffer.data)
+		return 0;
+	
+	unsigned count = drawCall.instanceTriangleCount();
+	unsigned instance = triangle / count;
+	triangle -= instance*count;
+	return instance;
+}
+
+inline bool adjacentTriangles(const DrawCall& drawCall, unsigned a, unsigned b) {
+	if (triangleInstance(drawCall, a) != triangleInstance(drawCall, b))
+		return false;
+	
+	const unsigned* adj = drawCall.adjacency + a*3;
+	return adj[0] == b || adj[1] == b || adj[2] == b;
+}
+
+/*
+ Attribute shader output is cached per vertex for the whole frame. A thread claims a vertex by
+ swapping its state to the frame's stamp with its slot and thread, shades it with the rest of the
+ tile, and then marks it shaded. Vertices claimed by other threads are shaded privately. States
+ hold the stamp in the top 8 bits, then the slot and the thread + 1 in 12 bits each. States with
+ the stamp of another frame are unclaimed.
+*/
+static const unsigned attributeStampShift = 24;
+static const unsigned attributeClaimBits = 12;
+static const unsigned attributeClaimMask = (1 << attributeClaimBits)-1;
+static const unsigned attributeShaded = 0x00ffffff; // No slot reaches 0xfff.
+static const unsigned attributeCached = 0x80000000;
+
+static inline SRAST_FORCEINLINE void copyAttributes(float* __restrict dst, const float* __restrict src, unsigned sizeInSSE) {
+	for (unsigned i = 0; i < sizeInSSE; ++i)
+		_mm_store_ps(dst + i*4, _mm_load_ps(src + i*4));
+}
+
+static inline SRAST_FORCEINLINE const float* shadedAttributes(unsigned ref, const float* cachedAttributes, const float* outAttributes, unsigned sizeInSSE) {
+	if (ref & attributeCached)
+		return cachedAttributes + (ref & ~attributeCached) * sizeInSSE * 4;
+	else
+		return outAttributes + ref * sizeInSSE * 4;
+}
+
+template<class Samples, class Color>
+static unsigned shadeDrawCallFragments(ResolveContext<Samples, Color>& context, const DrawCall* __restrict drawCalls, unsigned firstFragment, unsigned long long* __restrict fragments) {
 	float tx = context.tileX;
 	float ty = context.tileY;
 	
@@ -125,71 +388,114 @@ static unsigned shadeDrawCallFragments(ResolveContext& context, const DrawCall*
 	float* __restrict inAttributes = context.inAttributes;
 	float* __restrict outAttributes = context.outAttributes;
 
-	unsigned short drawCallIdx = fragments[firstFragment] >> 48;
-	const DrawCall& drawCall = drawCalls[drawCallIdx];
+	const DrawCall& drawCall = drawCalls[frameTriangleDrawCall(drawCalls, context.drawCallCount, fragments[firstFragment] >> 24)];
+	unsigned long long triangleBase = drawCall.triangleBase;
+	unsigned long long triangleEnd = triangleBase + drawCall.triangleCount();
 	
 	Shader* attributeShader = drawCall.attributeRenderState.getShader();
 		
 	unsigned inAttributeSizeInSSE = drawCall.attributeBuffer.stride / 16;
 	unsigned outAttributeSizeInSSE = attributeShader->outputStride() / 16;
 
-	// Gather per triangle input attributes.
+	// Gather input attributes for vertices that are not in the draw call's attribute cache.
+	const float* drawCallAttributes = static_cast<const float*>(drawCall.attributeBuffer.data);
+	float* cachedAttributes = drawCall.shadedAttributes;
+	unsigned* attributeRefs = context.attributeRefs;
+	unsigned* slotVertices = context.attributeSlotVertices;
+	unsigned stamp = context.attributeStamp << attributeStampShift;
+	unsigned claim = context.thread + 1;
+
 	unsigned lastFragment = firstFragment;
+	unsigned refCount = 0;
 	unsigned attributeCount = 0;
 		
 	do {
 		unsigned long long triangleRef = fragments[lastFragment];
-		unsigned triangle = (triangleRef >> 24) & 0xffffff;
-			
-		float* attributes0 = inAttributes + (attributeCount++) * inAttributeSizeInSSE * 4;
-		float* attributes1 = inAttributes + (attributeCount++) * inAttributeSizeInSSE * 4;
-		float* attributes2 = inAttributes + (attributeCount++) * inAttributeSizeInSSE * 4;
+		unsigned triangle = (unsigned)((triangleRef >> 24) - triangleBase);
 
+		// Instances share the attribute cache.
+		triangleInstance(drawCall, triangle);
 		int3 indices = triangleIndices(drawCall, triangle);
-			
-		const float* drawCallAttributes = static_cast<const float*>(drawCalls[drawCallIdx].attributeBuffer.data);
-		const float* drawCallAttributes0 = drawCallAttributes + indices.x * inAttributeSizeInSSE * 4;
-		const float* drawCallAttributes1 = drawCallAttributes + indices.y * inAttributeSizeInSSE * 4;
-		const float* drawCallAttributes2 = drawCallAttributes + indices.z * inAttributeSizeInSSE * 4;
 		
-		for (unsigned i = 0; i < inAttributeSizeInSSE; ++i) {
-			_mm_store_ps(attributes0 + i*4, _mm_load_ps(drawCallAttributes0 + i*4));
-			_mm_store_ps(attributes1 + i*4, _mm_load_ps(drawCallAttributes1 + i*4));
-			_mm_store_ps(attributes2 + i*4, _mm_load_ps(drawCallAttributes2 + i*4));
+		for (unsigned j = 0; j < 3; ++j) {
+			unsigned vertex = indices[j];
+			unsigned* state = drawCall.shadedAttributeStates + vertex;
+			unsigned s = Atomics::loadAcquire(reinterpret_cast<int*>(state));
+			
+			if ((s & ~attributeShaded) != stamp) {
+				unsigned unclaimed = s;
+				s = Atomics::compareAndSwap(reinterpret_cast<int*>(state), stamp | (attributeCount << attributeClaimBits) | claim, unclaimed);
+				
+				if (s == unclaimed) {
+					attributeRefs[refCount++] = attributeCount;
+					slotVertices[attributeCount] = vertex;
+					copyAttributes(inAttributes + attributeCount++ * inAttributeSizeInSSE * 4, drawCallAttributes + vertex * inAttributeSizeInSSE * 4, inAttributeSizeInSSE);
+					continue;
+				}
+			}
+			
+			s &= attributeShaded;
+			
+			if (s == attributeShaded) {
+				attributeRefs[refCount++] = vertex | attributeCached;
+			}
+			else if ((s & attributeClaimMask) == claim) {
+				// Claimed earlier in this tile.
+				attributeRefs[refCount++] = s >> attributeClaimBits;
+			}
+			else {
+				// Another thread is shading it. Shade a private copy rather than wait.
+				attributeRefs[refCount++] = attributeCount;
+				slotVertices[attributeCount] = ~0u;
+				copyAttributes(inAttributes + attributeCount++ * inAttributeSizeInSSE * 4, drawCallAttributes + vertex * inAttributeSizeInSSE * 4, inAttributeSizeInSSE);
+			}
 		}
 			
-		triangleRef &= FRAGCMP_DRAWCALL|FRAGCMP_TRIANGLE;
+		triangleRef &= FRAGCMP_TRIANGLE;
 
 		do {
 			++lastFragment;
 		}
-		while ((fragments[lastFragment] & (FRAGCMP_DRAWCALL|FRAGCMP_TRIANGLE)) == triangleRef);
+		while ((fragments[lastFragment] & (FRAGCMP_TRIANGLE)) == triangleRef);
 	}
-	while ((fragments[lastFragment] >> 48) == drawCallIdx);
+	while ((fragments[lastFragment] >> 24) < triangleEnd);
 	
 	unsigned maxDrawCallFragment = lastFragment;
 
-	// Run attribute shader.
-	drawCall.attributeRenderState.executeShader(inAttributes, outAttributes, attributeCount);
+	// Run attribute shader and publish the results.
+	if (attributeCount) {
+		drawCall.attributeRenderState.executeShader(inAttributes, outAttributes, attributeCount);
+		
+		for (unsigned i = 0; i < attributeCount; ++i) {
+			unsigned vertex = slotVertices[i];
+			
+			if (vertex == ~0u)
+				continue;
+			
+			copyAttributes(cachedAttributes + vertex * outAttributeSizeInSSE * 4, outAttributes + i * outAttributeSizeInSSE * 4, outAttributeSizeInSSE);
+			Atomics::compareAndSwap(reinterpret_cast<int*>(drawCall.shadedAttributeStates + vertex), stamp | attributeShaded, stamp | (i << attributeClaimBits) | claim);
+		}
+	}
 		
 	// Interpolate attributes to fragments.
 	lastFragment = firstFragment;
-	attributeCount = 0;
+	refCount = 0;
 
 	float halfWidth = context.halfWidth;
 	float halfHeight = context.halfHeight;
 		
 	do {
 		unsigned long long triangleRef = fragments[lastFragment];
-		unsigned triangle = (triangleRef >> 24) & 0xffffff;
+		unsigned triangle = (unsigned)((triangleRef >> 24) - triangleBase);
 
-		triangleRef &= FRAGCMP_DRAWCALL|FRAGCMP_TRIANGLE;
+		triangleRef &= FRAGCMP_TRIANGLE;
 
+		const float4* positions = drawCall.shadedPositions + triangleInstance(drawCall, triangle)*drawCall.vertexBuffer.count;
 		int3 indices = triangleIndices(drawCall, triangle);
 			
-		__m128 m0 = _mm_load_ps(&drawCall.shadedPositions[indices.x].x);
-		__m128 m1 = _mm_load_ps(&drawCall.shadedPositions[indices.y].x);
-		__m128 m2 = _mm_load_ps(&drawCall.shadedPositions[indices.z].x);
+		__m128 m0 = _mm_load_ps(&positions[indices.x].x);
+		__m128 m1 = _mm_load_ps(&positions[indices.y].x);
+		__m128 m2 = _mm_load_ps(&positions[indices.z].x);
 
 		__m128 x1x2y1y2 = _mm_unpacklo_ps(m1, m2);
 		__m128 x0ooy0oo = _mm_unpacklo_ps(m0, _mm_setzero_ps());
@@ -216,9 +522,9 @@ static unsigned shadeDrawCallFragments(ResolveContext& context, const DrawCall*
 		simd4_float ex = broadcast_first(sum_reduce(edges.x));
 		simd4_float ey = broadcast_first(sum_reduce(edges.y));
 
-		const float* triangleAttributes0 = outAttributes + (attributeCount++) * outAttributeSizeInSSE * 4;
-		const float* triangleAttributes1 = outAttributes + (attributeCount++) * outAttributeSizeInSSE * 4;
-		const float* triangleAttributes2 = outAttributes + (attributeCount++) * outAttributeSizeInSSE * 4;
+		const float* triangleAttributes0 = shadedAttributes(attributeRefs[refCount++], cachedAttributes, outAttributes, outAttributeSizeInSSE);
+		const float* triangleAttributes1 = shadedAttributes(attributeRefs[refCount++], cachedAttributes, outAttributes, outAttributeSizeInSSE);
+		const float* triangleAttributes2 = shadedAttributes(attributeRefs[refCount++], cachedAttributes, outAttributes, outAttributeSizeInSSE);
 			
 		do {
 			unsigned long long pixelRef = fragments[lastFragment];
@@ -274,7 +580,7 @@ static unsigned shadeDrawCallFragments(ResolveContext& context, const DrawCall*
 				
 			++lastFragment;
 		}
-		while ((fragments[lastFragment] & (FRAGCMP_DRAWCALL|FRAGCMP_TRIANGLE)) == triangleRef);
+		while ((fragments[lastFragment] & (FRAGCMP_TRIANGLE)) == triangleRef);
 	}
 	while (lastFragment < maxDrawCallFragment);
 		
@@ -284,138 +590,362 @@ static unsigned shadeDrawCallFragments(ResolveContext& context, const DrawCall*
 	return maxDrawCallFragment;
 }
 
-static void shadeFragmentsAndBlend(ResolveContext& context, const DrawCall* __restrict drawCalls, unsigned long long* __restrict triangleFragment) {
-	PixelSamples* __restrict targetPixelSamples = context.targetPixelSamples;
-	unsigned targetPixelCount = context.targetPixelCount;
+// Writes per-sample colors from the compressed colors.
+template<class Samples, class Color>
+static inline SRAST_FORCEINLINE void expandColors(PixelSamples<Samples, Color>& pixel) {
+	for (unsigned i = 0; i < pixel.colorCount; ++i) {
+		unsigned mask = pixel.colorMasks[i];
+
+		do {
+			pixel.c[__builtin_ctz(mask)] = pixel.colors[i];
+			mask &= mask-1;
+		}
+		while (mask);
+	}
+
+	pixel.colorCount = 0;
+}
+
+// Replaces the color of the given samples. Returns false if the colors must be expanded first.
+template<class Samples, class Color>
+static inline SRAST_FORCEINLINE bool storeCompressedColor(PixelSamples<Samples, Color>& pixel, unsigned samples, typename Color::Type color) {
+	unsigned colorCount = 0;
+
+	for (unsigned i = 0; i < pixel.colorCount; ++i) {
+		unsigned mask = pixel.colorMasks[i] & ~samples;
+
+		if (mask) {
+			pixel.colors[colorCount] = pixel.colors[i];
+			pixel.colorMasks[colorCount++] = mask;
+		}
+	}
+
+	pixel.colorCount = colorCount;
+
+	if (colorCount == PixelSamples<Samples, Color>::maxColors)
+		return false;
+
+	pixel.colors[colorCount] = color;
+	pixel.colorMasks[colorCount] = samples;
+	pixel.colorCount = colorCount+1;
+	return true;
+}
+
+// Blends a premultiplied color into the given samples. Compressed colors are blended once per entry.
+template<class Samples, class Color>
+static inline SRAST_FORCEINLINE void blendSamples(PixelSamples<Samples, Color>& pixel, unsigned samples, typename Color::Type sourcePixel) {
+	typename Color::Source source = Color::source(sourcePixel);
+
+	if (pixel.colorCount) {
+		// Entries partially covered by the samples are split, if there is room.
+		unsigned colorCount = pixel.colorCount;
+		unsigned splitCount = 0;
+
+		for (unsigned i = 0; i < colorCount; ++i)
+			splitCount += (pixel.colorMasks[i] & samples) && (pixel.colorMasks[i] & ~samples);
 
+		if (colorCount + splitCount <= PixelSamples<Samples, Color>::maxColors) {
+			for (unsigned i = 0; i < colorCount; ++i) {
+				unsigned mask = pixel.colorMasks[i];
+
+				if (!(mask & samples))
+					continue;
+
+				if (mask & ~samples) {
+					pixel.colors[pixel.colorCount] = pixel.colors[i];
+					pixel.colorMasks[pixel.colorCount++] = mask & ~samples;
+					pixel.colorMasks[i] = mask & samples;
+				}
+
+				pixel.colors[i] = Color::blend(source, pixel.colors[i]);
+			}
+
+			return;
+		}
+
+		expandColors(pixel);
+	}
+
+	Color::blend(source, pixel.c, samples);
+}
+
+// Shades the pending fragments of a blended draw call in one batch and blends them in order.
+template<class Samples, class Color>
+static void blendFragments(ResolveContext<Samples, Color>& context, const DrawCall* __restrict drawCalls) {
+	PixelSamples<Samples, Color>* __restrict targetPixelSamples = context.targetPixelSamples;
 	unsigned long long* __restrict fragments = context.fragments;
-	unsigned* __restrict outAttributes = reinterpret_cast<unsigned*>(context.outAttributes);
+	const typename Color::Type* __restrict outAttributes = reinterpret_cast<const typename Color::Type*>(context.outAttributes);
+
+	unsigned fragmentCount = context.blendFragmentCount;
+	context.blendFragmentCount = 0;
+
+	if (!fragmentCount)
+		return;
+
+	// Mark end.
+	fragments[fragmentCount] = 0xffffffffffffffffull;
+
+	// Shade fragments.
+	shadeDrawCallFragments(context, drawCalls, 0, fragments);
+
+	// Blend fragments.
+	for (unsigned i = 0; i < fragmentCount; ++i) {
+		unsigned samples = (unsigned)fragments[i] & 0xffff;
+		unsigned pixel = ((unsigned)fragments[i] >> 16) & 0xff;
+
+		blendSamples(targetPixelSamples[pixel], samples, outAttributes[i]);
+	}
+}
+
+/*
+ Moves the fragments of a triangle batch from the pixels to the tile's pending list, grouped by
+ triangle. Each pixel then sees its fragments in triangle order when they are blended.
+*/
+template<class Samples, class Color>
+static void gatherBlendFragments(ResolveContext<Samples, Color>& context, const DrawCall* __restrict drawCalls, const unsigned long long* __restrict triangleFragment) {
+	PixelSamples<Samples, Color>* __restrict targetPixelSamples = context.targetPixelSamples;
+	unsigned targetPixelCount = context.targetPixelCount;
+
+	unsigned long long* __restrict buckets = context.sortScratch;
 
-	// Gather fragments.
 	static const unsigned maxFragmentsPerTriLog2 = tileSizeLog2 + tileSizeLog2;
 	unsigned perTriFragmentCount[simd_float::width] = { 0 };
+	unsigned batchFragmentCount = 0;
 
 	for (unsigned i = 0; i < targetPixelCount; ++i) {
-		PixelSamples& samples = targetPixelSamples[i];
+		PixelSamples<Samples, Color>& samples = targetPixelSamples[i];
 		
 		if (!samples.fragmentCount)
 			continue;
 
 		for (unsigned j = 0; j < samples.fragmentCount; ++j) {
 			unsigned long long f = samples.fragments[j];
-			unsigned tri = f & 0xffffff;
+			unsigned tri = f & 0xff;
 
-			fragments[(tri << maxFragmentsPerTriLog2) + (perTriFragmentCount[tri]++)] = (f >> 24) | triangleFragment[tri];
+			buckets[(tri << maxFragmentsPerTriLog2) + (perTriFragmentCount[tri]++)] = ((f >> 8) & 0xffffff) | triangleFragment[tri];
 		}
 
+		batchFragmentCount += samples.fragmentCount;
 		samples.fragmentCount = 0;
 	}
 
-	unsigned fragmentCount = perTriFragmentCount[0];
+	if (context.blendFragmentCount + batchFragmentCount > context.shadedFragments)
+		blendFragments(context, drawCalls);
 
-	for (unsigned i = 1; i < simd_float::width; ++i) {
-		for (unsigned j = 0; j < perTriFragmentCount[i]; ++j) {
-			fragments[fragmentCount++] = fragments[(i << maxFragmentsPerTriLog2) + j];
-		}
+	unsigned long long* __restrict fragments = context.fragments;
+	unsigned fragmentCount = context.blendFragmentCount;
+
+	for (unsigned i = 0; i < simd_float::width; ++i) {
+		for (unsigned j = 0; j < perTriFragmentCount[i]; ++j)
+			fragments[fragmentCount++] = buckets[(i << maxFragmentsPerTriLog2) + j];
 	}
 
-	if (!fragmentCount)
+	context.blendFragmentCount = fragmentCount;
+}
+
+/*
+ Shades a list of transparent fragments and composites them back to front. Fragments are shaded
+ in draw call and triangle order with the entry index in the sample bits, then blended in depth order.
+*/
+template<class Samples, class Color, class ZMode>
+static void compositeOitFragments(ResolveContext<Samples, Color>& context, const DrawCall* __restrict drawCalls, const unsigned long long* __restrict keys, const float* __restrict depths, unsigned count) {
+	PixelSamples<Samples, Color>* __restrict targetPixelSamples = context.targetPixelSamples;
+	unsigned long long* __restrict fragments = context.fragments;
+	const typename Color::Type* __restrict outAttributes = reinterpret_cast<const typename Color::Type*>(context.outAttributes);
+	typename Color::Type* __restrict colors = context.oitColors;
+
+	if (!count)
 		return;
 
+	for (unsigned i = 0; i < count; ++i)
+		fragments[i] = (keys[i] & ~FRAGCMP_SAMPLES) | i;
+
+	radixSort<false>(fragments, context.sortScratch, count);
+
 	// Mark end.
-	fragments[fragmentCount] = 0xffffffffffffffffull;
+	fragments[count] = 0xffffffffffffffffull;
 
-	// Shade fragments.
-	shadeDrawCallFragments(context, drawCalls, 0, fragments);
+	unsigned firstFragment = 0;
 
-	// Blend fragments.
-	for (unsigned i = 0; i < fragmentCount; ++i) {
-		unsigned samples = (unsigned)fragments[i] & 0xffff;
-		unsigned pixel = ((unsigned)fragments[i] >> 16) & 0xff;
+	while (firstFragment < count) {
+		unsigned maxDrawCallFragment = shadeDrawCallFragments(context, drawCalls, firstFragment, fragments);
 
-		unsigned* dst = targetPixelSamples[pixel].c;
-		unsigned sourcePixel = outAttributes[i];
+		for (unsigned i = firstFragment; i < maxDrawCallFragment; ++i)
+			colors[fragments[i] & FRAGCMP_SAMPLES] = outAttributes[i - firstFragment];
 
-		__m128i sourcePattern = _mm_set1_epi32(sourcePixel);
-		__m128i sourceRgba = _mm_cvtepu8_epi16(sourcePattern);
+		firstFragment = maxDrawCallFragment;
+	}
 
-		__m128i alpha = _mm_shufflelo_epi16(sourceRgba, _MM_SHUFFLE(3,3,3,3));
-		__m128i invAlpha = _mm_sub_epi16(_mm_set1_epi16(0xff), alpha);
+	// Depths are positive, so their bits sort like the floats.
+	for (unsigned i = 0; i < count; ++i)
+		fragments[i] = ((unsigned long long)float_as_uint32(depths[i]) << 32) | i;
 
-		__m128i op1 = _mm_unpacklo_epi16(_mm_set1_epi16(0xff), invAlpha);
+	radixSort<!ZMode::sortDescending>(fragments, context.sortScratch, count);
 
-		do {
-			unsigned j = __builtin_ctz(samples);
-			
-			unsigned destPixel = dst[j];
-			__m128i destPattern = _mm_set1_epi32(destPixel);
+	for (unsigned i = 0; i < count; ++i) {
+		unsigned entry = (unsigned)fragments[i];
+		unsigned long long key = keys[entry];
+
+		blendSamples(targetPixelSamples[(key >> 16) & 0xff], key & 0xffff, colors[entry]);
+	}
+}
 
-			unsigned mask = 0;
+/*
+ Moves the fragments of a triangle batch from the pixels to their k-buffers. When a k-buffer is
+ full, the farthest fragment goes to the tail instead. The tail is always behind the k-buffers and
+ is composited early when it fills up, which is where ordering becomes approximate.
+*/
+template<class Samples, class Color, class ZMode>
+static void gatherOitFragments(ResolveContext<Samples, Color>& context, const DrawCall* __restrict drawCalls, const unsigned long long* __restrict triangleFragment) {
+	static const unsigned oitLayers = ResolveContext<Samples, Color>::oitLayers;
 
-			for (unsigned s = 0; s < samplesPerPixel; s += 4) { // Note: Cannot do this with AVX (float) since some samples might be Inf or Nan.
-				__m128i targetPattern = _mm_load_si128(reinterpret_cast<const __m128i*>(dst + s));
-				__m128i match = _mm_cmpeq_epi32(destPattern, targetPattern);
-				mask |= _mm_movemask_ps(_mm_castsi128_ps(match)) << s;
-			}
+	PixelSamples<Samples, Color>* __restrict targetPixelSamples = context.targetPixelSamples;
+	unsigned targetPixelCount = context.targetPixelCount;
 
-			mask &= samples;
-			samples &= ~mask;
+	for (unsigned i = 0; i < targetPixelCount; ++i) {
+		PixelSamples<Samples, Color>& samples = targetPixelSamples[i];
 
-			__m128i destRgba = _mm_cvtepu8_epi16(destPattern);
-			__m128i op2 = _mm_unpacklo_epi16(sourceRgba, destRgba);
-			__m128i result = _mm_madd_epi16(op1, op2);
+		if (!samples.fragmentCount)
+			continue;
 
-			result = _mm_add_epi32(result, _mm_set1_epi32(255/2));
+		unsigned long long* __restrict layers = context.oitFragments + i*oitLayers;
+		float* __restrict layerDepths = context.oitDepths + i*oitLayers;
 
-			// r/255 = (r + 1 + (r >> 8)) >> 8, r < 65535
-			result = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(result, _mm_set1_epi32(1)), _mm_srli_epi32(result, 8)), 8);
+		for (unsigned j = 0; j < samples.fragmentCount; ++j) {
+			unsigned long long f = samples.fragments[j];
+			unsigned long long fragment = ((f >> 8) & 0xffffff) | triangleFragment[f & 0xff];
+			float depth = uint32_as_float((unsigned)(f >> 32));
 
-			result = _mm_packus_epi32(result, result);
-			result = _mm_packus_epi16(result, result);
-			unsigned resultPixel = _mm_cvtsi128_si32(result);
+			unsigned layerCount = context.oitCounts[i];
 
-			do {
-				dst[__builtin_ctz(mask)] = resultPixel;
-				mask &= mask-1;
+			if (layerCount < oitLayers) {
+				layers[layerCount] = fragment;
+				layerDepths[layerCount] = depth;
+				context.oitCounts[i] = layerCount+1;
+				continue;
+			}
+
+			unsigned farthest = 0;
+
+			for (unsigned k = 1; k < oitLayers; ++k) {
+				if (ZMode::less(layerDepths[farthest], layerDepths[k]))
+					farthest = k;
+			}
+
+			if (ZMode::less(depth, layerDepths[farthest])) {
+				std::swap(fragment, layers[farthest]);
+				std::swap(depth, layerDepths[farthest]);
 			}
-			while (mask);
+
+			if (context.oitTailCount == ResolveContext<Samples, Color>::maxOitFragments) {
+				compositeOitFragments<Samples, Color, ZMode>(context, drawCalls, context.oitTailFragments, context.oitTailDepths, context.oitTailCount);
+				context.oitTailCount = 0;
+			}
+
+			context.oitTailFragments[context.oitTailCount] = fragment;
+			context.oitTailDepths[context.oitTailCount++] = depth;
+		}
+
+		samples.fragmentCount = 0;
+	}
+}
+
+// Composites the tail and then the k-buffers of all pixels.
+template<class Samples, class Color, class ZMode>
+static void compositeOit(ResolveContext<Samples, Color>& context, const DrawCall* __restrict drawCalls) {
+	static const unsigned oitLayers = ResolveContext<Samples, Color>::oitLayers;
+
+	compositeOitFragments<Samples, Color, ZMode>(context, drawCalls, context.oitTailFragments, context.oitTailDepths, context.oitTailCount);
+
+	unsigned count = 0;
+
+	for (unsigned i = 0; i < context.targetPixelCount; ++i) {
+		for (unsigned k = 0; k < context.oitCounts[i]; ++k) {
+			context.oitTailFragments[count] = context.oitFragments[i*oitLayers + k];
+			context.oitTailDepths[count++] = context.oitDepths[i*oitLayers + k];
+		}
+
+		context.oitCounts[i] = 0;
+	}
+
+	context.oitTailCount = 0;
+
+	compositeOitFragments<Samples, Color, ZMode>(context, drawCalls, context.oitTailFragments, context.oitTailDepths, count);
+}
+
+// Replaces the color of the given samples.
+template<class Samples>
+static inline SRAST_FORCEINLINE void storeSamples(unsigned* dst, unsigned samples, unsigned color) {
+	if (samples == Samples::mask) {
+		__m128 src = _mm_castsi128_ps(_mm_set1_epi32(color));
+
+		_mm_store_ps(reinterpret_cast<float*>(dst) + 0, src);
+
+		if (Samples::count >= 8) {
+			_mm_store_ps(reinterpret_cast<float*>(dst) + 4, src);
+		}
+
+		if (Samples::count >= 16) {
+			_mm_store_ps(reinterpret_cast<float*>(dst) + 8, src);
+			_mm_store_ps(reinterpret_cast<float*>(dst) + 12, src);
+		}
+	}
+	else {
+		unsigned i = __builtin_ctz(samples) & ~0x3;
+		samples >>= i;
+
+		do {
+			if (samples & 1) dst[i] = color;
+			if (samples & 2) dst[i+1] = color;
+			if (samples & 4) dst[i+2] = color;
+			if (samples & 8) dst[i+3] = color;
+			i += 4;
+			samples >>= 4;
 		}
 		while (samples);
 	}
 }
 
-static void shadeTile(ResolveContext& context, const DrawCall* __restrict drawCalls, bool earlyOut) {
+template<class Samples, class Type>
+static inline SRAST_FORCEINLINE void storeSamples(Type* dst, unsigned samples, const Type& color) {
+	do {
+		dst[__builtin_ctz(samples)] = color;
+		samples &= samples-1;
+	}
+	while (samples);
+}
+
+template<class Samples, class Color>
+static void shadeTile(ResolveContext<Samples, Color>& context, const DrawCall* __restrict drawCalls, bool earlyOut) {
 	unsigned targetPixelCount = context.targetPixelCount;
 
-	PixelSamples* __restrict targetPixelSamples = context.targetPixelSamples;
+	PixelSamples<Samples, Color>* __restrict targetPixelSamples = context.targetPixelSamples;
 	unsigned long long* __restrict fragments = context.fragments;
-	const unsigned* __restrict outAttributes = reinterpret_cast<const unsigned*>(context.outAttributes);
+	const typename Color::Type* __restrict outAttributes = reinterpret_cast<const typename Color::Type*>(context.outAttributes);
 	
 	// Gather fragments.
 	unsigned fragmentCount = 0;
 	
 	for (unsigned i = 0; i < targetPixelCount; ++i) {
-		PixelSamples& samples = targetPixelSamples[i];
+		PixelSamples<Samples, Color>& samples = targetPixelSamples[i];
 		
 		if (!samples.fragmentCount)
 			continue;
 		
 		if (samples.earlyOut) {
-			if (earlyOut && samples.sampleMask == ((1 << samplesPerPixel)-1)) {
+			if (earlyOut && samples.sampleMask == Samples::mask) {
 				if (!samples.isImportant || samples.fragmentCount == 1) {
 					// No important triangle or single fragment.
 					continue;
 				}
-				else if (samples.fragmentCount == 2 &&
-						 fragCmp(samples.fragments[0], samples.fragments[1], FRAGCMP_DRAWCALL) == 0) {
+				else if (samples.fragmentCount == 2) {
 					// Two fragments sharing edge.
-					unsigned drawCallIdx = samples.fragments[0] >> 48;
-					unsigned a = (samples.fragments[0] >> 24) & 0xffffff;
-					unsigned b = (samples.fragments[1] >> 24) & 0xffffff;
-					
-					const unsigned* adj = drawCalls[drawCallIdx].adjacency + a*3;
+					unsigned long long a = samples.fragments[0] >> 24;
+					unsigned long long b = samples.fragments[1] >> 24;
+					const DrawCall& drawCall = drawCalls[frameTriangleDrawCall(drawCalls, context.drawCallCount, a)];
 					
-					if (adj[0] == b || adj[1] == b || adj[2] == b) {
+					if (b - drawCall.triangleBase < drawCall.triangleCount() &&
+						adjacentTriangles(drawCall, (unsigned)(a - drawCall.triangleBase), (unsigned)(b - drawCall.triangleBase))) {
 						continue;
 					}
 				}
@@ -434,7 +964,7 @@ static void shadeTile(ResolveContext& context, const DrawCall* __restrict drawCa
 	fragments[fragmentCount] = 0xffffffffffffffffull;
 	
 	// Sort them.
-	quickSort(fragments, fragments + fragmentCount);
+	radixSort<false>(fragments, context.sortScratch, fragmentCount);
 	
 	// Process fragments for one draw call at a time.
 	unsigned firstFragment = 0;
@@ -446,44 +976,26 @@ static void shadeTile(ResolveContext& context, const DrawCall* __restrict drawCa
 		unsigned lastFragment = firstFragment;
 
 		do {
-			unsigned color = outAttributes[lastFragment - firstFragment];
+			typename Color::Type color = outAttributes[lastFragment - firstFragment];
 
 			unsigned long long fragment = fragments[lastFragment];
 
 			unsigned pixel = (fragment >> 16) & 0xff;
 			unsigned samples = fragment & 0xffff;
 
-			unsigned* dst = targetPixelSamples[pixel].c;
+			PixelSamples<Samples, Color>& pixelSamples = targetPixelSamples[pixel];
 
-			if (samples == (1 << samplesPerPixel)-1) {
-				__m128 src = _mm_castsi128_ps(_mm_set1_epi32(color));
-
-				_mm_store_ps(reinterpret_cast<float*>(dst) + 0, src);
-
-				if (samplesPerPixel >= 8) {
-					_mm_store_ps(reinterpret_cast<float*>(dst) + 4, src);
+			if (pixelSamples.colorCount) {
+				if (storeCompressedColor(pixelSamples, samples, color)) {
+					++lastFragment;
+					continue;
 				}
 
-				if (samplesPerPixel >= 16) {
-					_mm_store_ps(reinterpret_cast<float*>(dst) + 8, src);
-					_mm_store_ps(reinterpret_cast<float*>(dst) + 12, src);
-				}
-			}
-			else {
-				unsigned i = __builtin_ctz(samples) & ~0x3;
-				samples >>= i;
-
-				do {
-					if (samples & 1) dst[i] = color;
-					if (samples & 2) dst[i+1] = color;
-					if (samples & 4) dst[i+2] = color;
-					if (samples & 8) dst[i+3] = color;
-					i += 4;
-					samples >>= 4;
-				}
-				while (samples);
+				expandColors(pixelSamples);
 			}
 
+			storeSamples<Samples>(pixelSamples.c, samples, color);
+
 			++lastFragment;
 		}
 		while (lastFragment < maxDrawCallFragment);
@@ -494,187 +1006,441 @@ static void shadeTile(ResolveContext& context, const DrawCall* __restrict drawCa
 }
 
 #define TRIANGLE_LEFT(p)	p == 0 || tri + p < triangleCount
-#define TRIANGLE_INDEX(p)	triangles[tri + p].idx & 0xffffff
+#define TRIANGLE_INDEX(p)	chunkTriangles[triangles[tri + p].idx].triangle
 #define TRIANGLE_Z(p)		uint32_as_float(triangles[tri + p].z)
-#define TRIANGLE_DC(p)		drawCallMap[triangles[tri + p].idx >> 24]
+#define TRIANGLE_DC(p)		chunkTriangles[triangles[tri + p].idx].drawCall
 
-#define GATHER_TRIANGLE(m0, m1, m2, p) \
-__m128 m0, m1, m2;\
+#define GATHER_TRIANGLE(m0, m1, p) \
+__m128 m0, m1;\
 if (TRIANGLE_LEFT(p)) {\
 unsigned ind = TRIANGLE_INDEX(p);\
 unsigned dc = TRIANGLE_DC(p);\
-float4* edges = drawCalls[dc].edges;\
+const TriangleEdges& edges = drawCalls[dc].edges[ind];\
 importantMask += (drawCalls[dc].flags[ind] & FACEFLAG_IMPORTANT) << p;\
-m0 = _mm_load_ps(&edges[ind*4+0].x);\
-m1 = _mm_load_ps(&edges[ind*4+1].x);\
-m2 = _mm_load_ps(&edges[ind*4+2].x);\
-highpEdgeZ0[p] = drawCalls[dc].highpEdgeZ0[ind];\
-highpEdgeZ1[p] = drawCalls[dc].highpEdgeZ1[ind];\
-highpEdgeZ2[p] = drawCalls[dc].highpEdgeZ2[ind];\
-triangleFragment[p] = (((unsigned long long)ind << 24) | ((unsigned long long)dc << 48));\
+m0 = _mm_load_ps(reinterpret_cast<const float*>(edges.a));\
+m1 = _mm_load_ps(reinterpret_cast<const float*>(edges.b));\
+edgeC0[p] = edges.c[0];\
+edgeC1[p] = edges.c[1];\
+edgeC2[p] = edges.c[2];\
+planeZ[p] = edges.z;\
+triangleFragment[p] = (drawCalls[dc].triangleBase + ind) << 24;\
 triangleZ[p] = TRIANGLE_Z(p);\
 laneMask += laneMask + 1;\
 }
 
-#define GATHER_TRIANGLE_LO(m0, m1, m2, p) \
-__m256 m0, m1, m2;\
+#define GATHER_TRIANGLE_LO(m0, m1, p) \
+__m256 m0, m1;\
 if (TRIANGLE_LEFT(p)) {\
 unsigned ind = TRIANGLE_INDEX(p);\
 unsigned dc = TRIANGLE_DC(p);\
-float4* edges = drawCalls[dc].edges;\
+const TriangleEdges& edges = drawCalls[dc].edges[ind];\
 importantMask += (drawCalls[dc].flags[ind] & FACEFLAG_IMPORTANT) << p;\
-m0 = _mm256_castps128_ps256(_mm_load_ps(&edges[ind*4+0].x));\
-m1 = _mm256_castps128_ps256(_mm_load_ps(&edges[ind*4+1].x));\
-m2 = _mm256_castps128_ps256(_mm_load_ps(&edges[ind*4+2].x));\
-highpEdgeZ0[p] = drawCalls[dc].highpEdgeZ0[ind];\
-highpEdgeZ1[p] = drawCalls[dc].highpEdgeZ1[ind];\
-highpEdgeZ2[p] = drawCalls[dc].highpEdgeZ2[ind];\
-triangleFragment[p] = (((unsigned long long)ind << 24) | ((unsigned long long)dc << 48));\
+m0 = _mm256_castps128_ps256(_mm_load_ps(reinterpret_cast<const float*>(edges.a)));\
+m1 = _mm256_castps128_ps256(_mm_load_ps(reinterpret_cast<const float*>(edges.b)));\
+edgeC0[p] = edges.c[0];\
+edgeC1[p] = edges.c[1];\
+edgeC2[p] = edges.c[2];\
+planeZ[p] = edges.z;\
+triangleFragment[p] = (drawCalls[dc].triangleBase + ind) << 24;\
 triangleZ[p] = TRIANGLE_Z(p);\
 laneMask += laneMask + 1;\
 }
 
-#define GATHER_TRIANGLE_HI(m0, m1, m2, p) \
+#define GATHER_TRIANGLE_HI(m0, m1, p) \
 if (TRIANGLE_LEFT(p)) {\
 unsigned ind = TRIANGLE_INDEX(p);\
 unsigned dc = TRIANGLE_DC(p);\
-float4* edges = drawCalls[dc].edges;\
+const TriangleEdges& edges = drawCalls[dc].edges[ind];\
 importantMask += (drawCalls[dc].flags[ind] & FACEFLAG_IMPORTANT) << p;\
-m0 = _mm256_insertf128_ps(m0, _mm_load_ps(&edges[ind*4+0].x), 1);\
-m1 = _mm256_insertf128_ps(m1, _mm_load_ps(&edges[ind*4+1].x), 1);\
-m2 = _mm256_insertf128_ps(m2, _mm_load_ps(&edges[ind*4+2].x), 1);\
-highpEdgeZ0[p] = drawCalls[dc].highpEdgeZ0[ind];\
-highpEdgeZ1[p] = drawCalls[dc].highpEdgeZ1[ind];\
-highpEdgeZ2[p] = drawCalls[dc].highpEdgeZ2[ind];\
-triangleFragment[p] = (((unsigned long long)ind << 24) | ((unsigned long long)dc << 48));\
+m0 = _mm256_insertf128_ps(m0, _mm_load_ps(reinterpret_cast<const float*>(edges.a)), 1);\
+m1 = _mm256_insertf128_ps(m1, _mm_load_ps(reinterpret_cast<const float*>(edges.b)), 1);\
+edgeC0[p] = edges.c[0];\
+edgeC1[p] = edges.c[1];\
+edgeC2[p] = edges.c[2];\
+planeZ[p] = edges.z;\
+triangleFragment[p] = (drawCalls[dc].triangleBase + ind) << 24;\
 triangleZ[p] = TRIANGLE_Z(p);\
 laneMask += laneMask + 1;\
 }
 
-template<class ZMode, bool Opaque, bool ZWrite>
-static void resolveDrawCall(unsigned tileZmax, ResolveContext& context, const DrawCall* __restrict drawCalls, unsigned startDrawCallIdx, CompositeBinList& bin, unsigned& idx, unsigned clearColor) {
-	
-	PixelSamples* __restrict targetPixelSamples = context.targetPixelSamples;
-	float* __restrict targetPixelsX = context.targetPixelsX;
-	float* __restrict targetPixelsY = context.targetPixelsY;
-	unsigned targetPixelCount = context.targetPixelCount;
-	float tx = context.tileX;
-	float ty = context.tileY;
+// Exact c + a*x + b*y in pixels, where x and y are in 1/32 pixels. See TriangleEdges.
+inline void evaluateEdge(double* __restrict result, const simd_float& a, const simd_float& b, const long long* __restrict c, int x, int y) {
+	SRAST_SIMD_ALIGNED int aa[simd_float::width], ba[simd_float::width];
 
-	// Read all triangles, then sort them. Allows us to do occlusion culling.
-	unsigned drawCallMap[256];
-	unsigned currentDCMapPos = 0;
+	a.store(reinterpret_cast<float*>(aa));
+	b.store(reinterpret_cast<float*>(ba));
 
-	FragmentRenderState fragmentRenderState = drawCalls[startDrawCallIdx].fragmentRenderState;
-	
-	drawCallMap[currentDCMapPos] = startDrawCallIdx;
+	__m128i mx = _mm_set1_epi64x(x);
+	__m128i my = _mm_set1_epi64x(y);
 
-	BinnedTriangle* __restrict triangles = context.triangles;
-	unsigned triangleCount = 0;
-	
-	for (;;) {
-		for (;;) {
-			idx = bin.next();
-			
-			if (idx & 0x80000000)
-				break;
-			
-			BinnedTriangle tri = {
-				idx | (currentDCMapPos << 24),
-				bin.depth(),
-			};
-			
-			if (ZMode::less(tri.z, tileZmax))
-				triangles[triangleCount++] = tri;
+	for (unsigned i = 0; i < simd_float::width; i += 2) {
+		__m128i ma = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(aa+i)));
+		__m128i mb = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(ba+i)));
+		__m128i mc = _mm_load_si128(reinterpret_cast<const __m128i*>(c+i));
+
+		mc = _mm_add_epi64(mc, _mm_add_epi64(_mm_mul_epi32(ma, mx), _mm_mul_epi32(mb, my)));
+
+		(int64_to_double(mc) * simd2_double(1.0/512.0)).store(result+i);
+	}
+}
+
+// Large edge values are clamped to 2^23/512 pixels, which keeps all sample tests exact in float.
+inline simd_double clampEdge(const simd_double& e) {
+	return min(max(e, simd_double(-16384.0)), simd_double(16384.0));
+}
+
+// Resolves the samples of one pixel against one triangle.
+template<class Samples, class Color, class ZMode, bool Opaque, bool ZWrite>
+static inline SRAST_FORCEINLINE void resolveTrianglePixel(PixelSamples<Samples, Color>& samples, unsigned& pixelSampleMask, float& pixelZmax, unsigned p, unsigned tri,
+											unsigned long long triangleFragment, float triangleZ, bool fullyCovered,
+											const float* tl0a, const float* tl1a, const float* tl2a, const float* tlza, unsigned lane,
+											const float* __restrict LUT0, const float* __restrict LUT1, const float* __restrict LUT2, const float* __restrict LUTZ) {
+	simd_float zmax = pixelZmax;
+	
+	if (pixelSampleMask == Samples::mask && ZMode::less(pixelZmax, triangleZ))
+		return;
+
+	simd_float tl0 = simd_float::broadcast_load(tl0a+lane);
+	simd_float tl1 = simd_float::broadcast_load(tl1a+lane);
+	simd_float tl2 = simd_float::broadcast_load(tl2a+lane);
+	simd_float tlz = simd_float::broadcast_load(tlza+lane);
+
+	// Coverage first. Depth is only evaluated for sample groups with covered samples.
+	unsigned coverageMask = 0;
+
+	for (unsigned s = 0; s < Samples::stride && !fullyCovered; s += simd_float::width) {
+		unsigned lutIdx = tri*Samples::stride + s;
+
+		simd_float lut0, lut1, lut2;
+
+		lut0.load(&LUT0[lutIdx]);
+		lut1.load(&LUT1[lutIdx]);
+		lut2.load(&LUT2[lutIdx]);
+
+		coverageMask |= mask((lut0 + tl0) | (lut1 + tl1) | (lut2 + tl2)) << s;
+	}
+
+	coverageMask = ~coverageMask & Samples::mask;
+
+	if (!coverageMask)
+		return;
+
+	unsigned triangleSampleMask = 0;
+	simd_float fragmentZ(SRAST_NEAR_Z);
+
+	for (unsigned s = 0; s < Samples::stride; s += simd_float::width) {
+		if (!((coverageMask >> s) & ((1 << simd_float::width)-1)))
+			continue;
+
+		unsigned lutIdx = tri*Samples::stride + s;
+
+		simd_float lutz;
+		lutz.load(&LUTZ[lutIdx]);
+
+		simd_float z = lutz + tlz;
+
+		simd_float oldZ;
+		oldZ.load(&samples.z[s]);
+
+		simd_float sampleMask = ZMode::test(z, oldZ);
+
+		if (!fullyCovered) {
+			simd_float lut0, lut1, lut2;
+
+			lut0.load(&LUT0[lutIdx]);
+			lut1.load(&LUT1[lutIdx]);
+			lut2.load(&LUT2[lutIdx]);
+
+			sampleMask = not_and((lut0 + tl0) | (lut1 + tl1) | (lut2 + tl2), sampleMask);
 		}
-		
-		if (!Opaque) // Can only handle one draw call at a time if blending is active.
-			break;
-		
-		if (currentDCMapPos == 255)
-			break;
-		
-		unsigned drawCallIndex = idx & (~0x80000000);
-		
-		if (drawCallIndex == 0x0fffffff)
-			break;
-		
-		if (fragmentRenderState != drawCalls[drawCallIndex].fragmentRenderState)
-			break;
-		
-		drawCallMap[++currentDCMapPos] = drawCallIndex;
+
+		if (ZWrite) {
+			blend(oldZ, z, sampleMask).store(&samples.z[s]);
+			zmax = blend(zmax, ZMode::max(z, zmax), sampleMask);
+		}
+
+		if (!Opaque)
+			fragmentZ = ZMode::max(fragmentZ, blend(simd_float(SRAST_NEAR_Z), z, sampleMask));
+
+		triangleSampleMask |= mask(sampleMask) << s;
 	}
 	
-	if (Opaque && ZWrite) {
-		typename ZMode::SortComparator cmp;
-		quickSort(reinterpret_cast<unsigned long long*>(triangles), reinterpret_cast<unsigned long long*>(triangles) + triangleCount, cmp);
+	triangleSampleMask &= Samples::mask;
+	
+	if (Opaque)
+		pixelSampleMask |= triangleSampleMask;
+	
+	if (ZWrite)
+		pixelZmax = ZMode::max_reduce(zmax).first_float();
+
+	if (triangleSampleMask) {
+		unsigned fragmentCount = samples.fragmentCount;
+		unsigned long long* fragments = samples.fragments;
+
+		if (Opaque) {
+			unsigned long long f = (triangleSampleMask | (p << 16)) | triangleFragment;
+			unsigned long long sc = ~((unsigned long long)triangleSampleMask);
+
+			unsigned i = 0;
+
+			for (; i < fragmentCount; ++i) {
+				if (((fragments[i] &= sc) & 0xffff) == 0) {
+					fragments[i] = f;
+					f = 0;
+				}
+			}
+
+			if (f) {
+				fragments[fragmentCount++] = f;
+				samples.fragmentCount = fragmentCount;
+			}
+		}
+		else {
+			// Note: Custom fragment for shade and blend, with the depth of the farthest sample on top.
+			unsigned long long f = tri | ((unsigned long long)(triangleSampleMask | (p << 16)) << 8);
+			f |= (unsigned long long)float_as_uint32(ZMode::max_reduce(fragmentZ).first_float()) << 32;
+
+			fragments[fragmentCount++] = f;
+			samples.fragmentCount = fragmentCount;
+		}
+	}
+}
+
+/*
+ Resolves a batch of triangles with lanes across pixels, one triangle at a time. Pixels see the
+ triangles in the same order as with lanes across triangles, so the result is identical.
+*/
+template<class Samples, class Color, class ZMode, bool Opaque, bool ZWrite>
+static SRAST_NOINLINE void resolveBatchPixelParallel(ResolveContext<Samples, Color>& context, const simd_float3& edge0, const simd_float3& edge1, const simd_float3& edge2,
+									  const simd_float& edge0min, const simd_float& edge1min, const simd_float& edge2min, const simd_float& z0, const simd_float& z1,
+									  const unsigned long long* triangleFragment, const float* triangleZ, unsigned laneMask, unsigned importantMask, unsigned long long& activePixels,
+									  const float* __restrict LUT0, const float* __restrict LUT1, const float* __restrict LUT2, const float* __restrict LUTZ) {
+	PixelSamples<Samples, Color>* __restrict targetPixelSamples = context.targetPixelSamples;
+	const float* __restrict targetPixelsX = context.targetPixelsX;
+	const float* __restrict targetPixelsY = context.targetPixelsY;
+	unsigned targetPixelCount = context.targetPixelCount;
+
+	SRAST_SIMD_ALIGNED float edge0xa[simd_float::width], edge0ya[simd_float::width], edge0za[simd_float::width], edge0mina[simd_float::width];
+	SRAST_SIMD_ALIGNED float edge1xa[simd_float::width], edge1ya[simd_float::width], edge1za[simd_float::width], edge1mina[simd_float::width];
+	SRAST_SIMD_ALIGNED float edge2xa[simd_float::width], edge2ya[simd_float::width], edge2za[simd_float::width], edge2mina[simd_float::width];
+	SRAST_SIMD_ALIGNED float z0a[simd_float::width], z1a[simd_float::width];
+
+	edge0.x.store(edge0xa);
+	edge0.y.store(edge0ya);
+	edge0.z.store(edge0za);
+	edge0min.store(edge0mina);
+	edge1.x.store(edge1xa);
+	edge1.y.store(edge1ya);
+	edge1.z.store(edge1za);
+	edge1min.store(edge1mina);
+	edge2.x.store(edge2xa);
+	edge2.y.store(edge2ya);
+	edge2.z.store(edge2za);
+	edge2min.store(edge2mina);
+	z0.store(z0a);
+	z1.store(z1a);
+
+	// Triangles each pixel should see after the depth reject of fully covered pixels.
+	unsigned char pixelTriangles[1 << (tileSizeLog2 + tileSizeLog2)];
+
+	simd_float tz;
+	tz.load(triangleZ);
+
+	for (unsigned p = 0; p < targetPixelCount; ++p) {
+		unsigned long long pixelBit = 1ull << (unsigned long long)p;
+		unsigned pixelMask = laneMask;
+
+		if (Opaque && ZWrite) {
+			if ((activePixels & pixelBit) == 0)
+				pixelMask = 0;
+		}
+
+		if (pixelMask && targetPixelSamples[p].sampleMask == Samples::mask) {
+			pixelMask &= mask(ZMode::less(tz, targetPixelSamples[p].zmax));
+
+			if (!pixelMask) {
+				if (Opaque && ZWrite)
+					activePixels ^= pixelBit;
+			}
+		}
+
+		pixelTriangles[p] = (unsigned char)pixelMask;
+	}
+
+	for (unsigned triangleMask = laneMask; triangleMask; triangleMask &= triangleMask-1) {
+		unsigned tri = __builtin_ctz(triangleMask);
+		unsigned triangleBit = 1 << tri;
+
+		simd_float e0x = simd_float::broadcast_load(edge0xa+tri), e0y = simd_float::broadcast_load(edge0ya+tri);
+		simd_float e1x = simd_float::broadcast_load(edge1xa+tri), e1y = simd_float::broadcast_load(edge1ya+tri);
+		simd_float e2x = simd_float::broadcast_load(edge2xa+tri), e2y = simd_float::broadcast_load(edge2ya+tri);
+		simd_float e0z = simd_float::broadcast_load(edge0za+tri), e0min = simd_float::broadcast_load(edge0mina+tri);
+		simd_float e1z = simd_float::broadcast_load(edge1za+tri), e1min = simd_float::broadcast_load(edge1mina+tri);
+		simd_float e2z = simd_float::broadcast_load(edge2za+tri), e2min = simd_float::broadcast_load(edge2mina+tri);
+		simd_float zx = simd_float::broadcast_load(z0a+tri), zy = simd_float::broadcast_load(z1a+tri);
+
+		for (unsigned g = 0; g < targetPixelCount; g += simd_float::width) {
+			simd_float px, py;
+			px.load(targetPixelsX+g);
+			py.load(targetPixelsY+g);
+
+			simd_float tl0 = mad(e0x, px, e0y*py);
+			simd_float tl1 = mad(e1x, px, e1y*py);
+			simd_float tl2 = mad(e2x, px, e2y*py);
+
+			unsigned groupMask = targetPixelCount-g < simd_float::width ? (1 << (targetPixelCount-g))-1 : (1 << simd_float::width)-1;
+			unsigned coveredMask = groupMask & ~mask((tl0 + e0z) | (tl1 + e1z) | (tl2 + e2z));
+
+			if (!coveredMask)
+				continue;
+
+			unsigned fullyCoveredMask = coveredMask & ~mask((tl0 + e0min) | (tl1 + e1min) | (tl2 + e2min));
+
+			SRAST_SIMD_ALIGNED float tl0a[simd_float::width];
+			SRAST_SIMD_ALIGNED float tl1a[simd_float::width];
+			SRAST_SIMD_ALIGNED float tl2a[simd_float::width];
+			SRAST_SIMD_ALIGNED float tlza[simd_float::width];
+
+			simd_float tlz = mad(zx, px, zy*py);
+
+			tl0.store(tl0a);
+			tl1.store(tl1a);
+			tl2.store(tl2a);
+			tlz.store(tlza);
+
+			do {
+				unsigned i = __builtin_ctz(coveredMask);
+				coveredMask &= coveredMask-1;
+
+				unsigned p = g + i;
+
+				if (!(pixelTriangles[p] & triangleBit))
+					continue;
+
+				if (Opaque) {
+					if (importantMask & triangleBit)
+						targetPixelSamples[p].isImportant = 1;
+				}
+
+				resolveTrianglePixel<Samples, Color, ZMode, Opaque, ZWrite>(targetPixelSamples[p], targetPixelSamples[p].sampleMask, targetPixelSamples[p].zmax, p, tri, triangleFragment[tri], triangleZ[tri], ((fullyCoveredMask >> i) & 1) != 0,
+					tl0a, tl1a, tl2a, tlza, i, LUT0, LUT1, LUT2, LUTZ);
+			}
+			while (coveredMask);
+		}
 	}
+}
+
+template<class Samples, class Color, class ZMode, bool Opaque, bool ZWrite, bool Oit>
+static void resolveTriangles(ResolveContext<Samples, Color>& context, const DrawCall* __restrict drawCalls, unsigned triangleCount) {
+	
+	PixelSamples<Samples, Color>* __restrict targetPixelSamples = context.targetPixelSamples;
+	float* __restrict targetPixelsX = context.targetPixelsX;
+	float* __restrict targetPixelsY = context.targetPixelsY;
+	unsigned targetPixelCount = context.targetPixelCount;
+	float tx = context.tileX;
+	float ty = context.tileY;
+	const float* __restrict sampleLocationsX = context.samplePattern->x;
+	const float* __restrict sampleLocationsY = context.samplePattern->y;
+
+	BinnedTriangle* __restrict triangles = context.triangles;
+	const ChunkTriangle* __restrict chunkTriangles = context.chunkTriangles;
+	
+	if (Opaque && ZWrite)
+		radixSort<ZMode::sortDescending>(reinterpret_cast<unsigned long long*>(triangles), context.sortScratch, triangleCount);
 
 	unsigned long long activePixels = (~0ull) >> (64-targetPixelCount);
+	
+	// Lanes run across triangles by default. With few triangles, run them across pixels instead.
+	bool pixelParallel = triangleCount*pixelParallelRatio < targetPixelCount;
 
 	for (unsigned tri = 0; tri < triangleCount; tri += simd_float::width) {
 		unsigned long long triangleFragment[simd_float::width];
 		SRAST_SIMD_ALIGNED float triangleZ[simd_float::width];
-		SRAST_SIMD_ALIGNED double highpEdgeZ0[simd_float::width];
-		SRAST_SIMD_ALIGNED double highpEdgeZ1[simd_float::width];
-		SRAST_SIMD_ALIGNED double highpEdgeZ2[simd_float::width];
+		SRAST_SIMD_ALIGNED float planeZ[simd_float::width];
+		SRAST_SIMD_ALIGNED long long edgeC0[simd_float::width];
+		SRAST_SIMD_ALIGNED long long edgeC1[simd_float::width];
+		SRAST_SIMD_ALIGNED long long edgeC2[simd_float::width];
 		unsigned laneMask = 0;
 		unsigned importantMask = 0;
 		
 #ifdef SRAST_AVX
-		GATHER_TRIANGLE_LO(m00, m01, m02, 0);
-		GATHER_TRIANGLE_LO(m10, m11, m12, 1);
-		GATHER_TRIANGLE_LO(m20, m21, m22, 2);
-		GATHER_TRIANGLE_LO(m30, m31, m32, 3);
+		GATHER_TRIANGLE_LO(m00, m01, 0);
+		GATHER_TRIANGLE_LO(m10, m11, 1);
+		GATHER_TRIANGLE_LO(m20, m21, 2);
+		GATHER_TRIANGLE_LO(m30, m31, 3);
 		
-		GATHER_TRIANGLE_HI(m00, m01, m02, 4);
-		GATHER_TRIANGLE_HI(m10, m11, m12, 5);
-		GATHER_TRIANGLE_HI(m20, m21, m22, 6);
-		GATHER_TRIANGLE_HI(m30, m31, m32, 7);
+		GATHER_TRIANGLE_HI(m00, m01, 4);
+		GATHER_TRIANGLE_HI(m10, m11, 5);
+		GATHER_TRIANGLE_HI(m20, m21, 6);
+		GATHER_TRIANGLE_HI(m30, m31, 7);
 		
 		SRAST_MM256_TRANSPOSE4_PS(m00, m10, m20, m30);
 		SRAST_MM256_TRANSPOSE4_PS(m01, m11, m21, m31);
-		SRAST_MM256_TRANSPOSE4_PS(m02, m12, m22, m32);
 #else
-		GATHER_TRIANGLE(m00, m01, m02, 0);
-		GATHER_TRIANGLE(m10, m11, m12, 1);
-		GATHER_TRIANGLE(m20, m21, m22, 2);
-		GATHER_TRIANGLE(m30, m31, m32, 3);
+		GATHER_TRIANGLE(m00, m01, 0);
+		GATHER_TRIANGLE(m10, m11, 1);
+		GATHER_TRIANGLE(m20, m21, 2);
+		GATHER_TRIANGLE(m30, m31, 3);
 
 		_MM_TRANSPOSE4_PS(m00, m10, m20, m30);
 		_MM_TRANSPOSE4_PS(m01, m11, m21, m31);
-		_MM_TRANSPOSE4_PS(m02, m12, m22, m32);
 #endif
 		
 		importantMask >>= 3; // Compensate for flag's bit-position.
 
-		simd_float3 edge0(m00, m10, m20);
-		simd_float3 edge1(m01, m11, m21);
-		simd_float3 edge2(m02, m12, m22);
+		simd_float3 edge0(int32_to_float(m00) * (1.0f / 16.0f), int32_to_float(m01) * (1.0f / 16.0f), simd_float::zero());
+		simd_float3 edge1(int32_to_float(m10) * (1.0f / 16.0f), int32_to_float(m11) * (1.0f / 16.0f), simd_float::zero());
+		simd_float3 edge2(int32_to_float(m20) * (1.0f / 16.0f), int32_to_float(m21) * (1.0f / 16.0f), simd_float::zero());
 		
 		simd_float z0(m30);
 		simd_float z1(m31);
-		simd_float z2(m32);
+		simd_float z2;
+		z2.load(planeZ);
 
 		z2 += z0*tx + z1*ty;
 		
-		simd_double hpe0zl, hpe1zl, hpe2zl;
-		simd_double hpe0zh, hpe1zh, hpe2zh;
-		simd_double txd(tx), tyd(ty);
-		
-		hpe0zl.load(highpEdgeZ0);
-		hpe0zh.load(highpEdgeZ0 + simd_double::width);
-		hpe1zl.load(highpEdgeZ1);
-		hpe1zh.load(highpEdgeZ1 + simd_double::width);
-		hpe2zl.load(highpEdgeZ2);
-		hpe2zh.load(highpEdgeZ2 + simd_double::width);
-		
-		edge0.z = double2float(hpe0zl + txd*float2double_lo(edge0.x) + tyd*float2double_lo(edge0.y),
-							   hpe0zh + txd*float2double_hi(edge0.x) + tyd*float2double_hi(edge0.y));
-		edge1.z = double2float(hpe1zl + txd*float2double_lo(edge1.x) + tyd*float2double_lo(edge1.y),
-							   hpe1zh + txd*float2double_hi(edge1.x) + tyd*float2double_hi(edge1.y));
-		edge2.z = double2float(hpe2zl + txd*float2double_lo(edge2.x) + tyd*float2double_lo(edge2.y),
-							   hpe2zh + txd*float2double_hi(edge2.x) + tyd*float2double_hi(edge2.y));
+		// Rebase edges to the tile center in integer.
+		SRAST_SIMD_ALIGNED double edge0c[simd_float::width];
+		SRAST_SIMD_ALIGNED double edge1c[simd_float::width];
+		SRAST_SIMD_ALIGNED double edge2c[simd_float::width];
+
+		int tx32 = (int)(tx*32.0f);
+		int ty32 = (int)(ty*32.0f);
+
+		evaluateEdge(edge0c, m00, m01, edgeC0, tx32, ty32);
+		evaluateEdge(edge1c, m10, m11, edgeC1, tx32, ty32);
+		evaluateEdge(edge2c, m20, m21, edgeC2, tx32, ty32);
+
+		simd_double e0cl, e1cl, e2cl;
+		simd_double e0ch, e1ch, e2ch;
+
+		e0cl.load(edge0c);
+		e0ch.load(edge0c + simd_double::width);
+		e1cl.load(edge1c);
+		e1ch.load(edge1c + simd_double::width);
+		e2cl.load(edge2c);
+		e2ch.load(edge2c + simd_double::width);
+
+		// Long edges are rebased per pixel. The sample offsets then stay exact for edges up to 16384 pixels.
+		simd_float edgeLength = max(abs(edge0.x) + abs(edge0.y), max(abs(edge1.x) + abs(edge1.y), abs(edge2.x) + abs(edge2.y)));
+		bool longEdges = (mask(edgeLength >= simd_float(2048.0f)) & laneMask) != 0;
+
+		simd_double e0xl, e0yl, e1xl, e1yl, e2xl, e2yl;
+		simd_double e0xh, e0yh, e1xh, e1yh, e2xh, e2yh;
+
+		if (longEdges) {
+			e0xl = float2double_lo(edge0.x); e0xh = float2double_hi(edge0.x);
+			e0yl = float2double_lo(edge0.y); e0yh = float2double_hi(edge0.y);
+			e1xl = float2double_lo(edge1.x); e1xh = float2double_hi(edge1.x);
+			e1yl = float2double_lo(edge1.y); e1yh = float2double_hi(edge1.y);
+			e2xl = float2double_lo(edge2.x); e2xh = float2double_hi(edge2.x);
+			e2yl = float2double_lo(edge2.y); e2yh = float2double_hi(edge2.y);
+		}
+		else {
+			edge0.z = double2float(clampEdge(e0cl), clampEdge(e0ch));
+			edge1.z = double2float(clampEdge(e1cl), clampEdge(e1ch));
+			edge2.z = double2float(clampEdge(e2cl), clampEdge(e2ch));
+		}
 
 		SRAST_SIMD_ALIGNED float edge0xa[simd_float::width], edge0ya[simd_float::width], edge0za[simd_float::width];
 		SRAST_SIMD_ALIGNED float edge1xa[simd_float::width], edge1ya[simd_float::width], edge1za[simd_float::width];
@@ -694,19 +1460,19 @@ static void resolveDrawCall(unsigned tileZmax, ResolveContext& context, const Dr
 		z1.store(z1a);
 		z2.store(z2a);
 		
-		SRAST_SIMD_ALIGNED float LUT0[simd_float::width*samplesPerPixel];
-		SRAST_SIMD_ALIGNED float LUT1[simd_float::width*samplesPerPixel];
-		SRAST_SIMD_ALIGNED float LUT2[simd_float::width*samplesPerPixel];
-		SRAST_SIMD_ALIGNED float LUTZ[simd_float::width*samplesPerPixel];
+		SRAST_SIMD_ALIGNED float LUT0[simd_float::width*Samples::stride];
+		SRAST_SIMD_ALIGNED float LUT1[simd_float::width*Samples::stride];
+		SRAST_SIMD_ALIGNED float LUT2[simd_float::width*Samples::stride];
+		SRAST_SIMD_ALIGNED float LUTZ[simd_float::width*Samples::stride];
 		
 		for (unsigned i = 0; i < simd_float::width; ++i) {
-			for (unsigned j = 0; j < samplesPerPixel; j += simd_float::width) {
+			for (unsigned j = 0; j < Samples::stride; j += simd_float::width) {
 				simd_float locX, locY;
 				
 				locX.load(&sampleLocationsX[j]);
 				locY.load(&sampleLocationsY[j]);
 				
-				unsigned idx = i*samplesPerPixel + j;
+				unsigned idx = i*Samples::stride + j;
 				
 				simd_float lut0 = mad(locX, simd_float::broadcast_load(edge0xa+i), mad(locY, simd_float::broadcast_load(edge0ya+i), simd_float::broadcast_load(edge0za+i)));
 				simd_float lut1 = mad(locX, simd_float::broadcast_load(edge1xa+i), mad(locY, simd_float::broadcast_load(edge1ya+i), simd_float::broadcast_load(edge1za+i)));
@@ -720,12 +1486,22 @@ static void resolveDrawCall(unsigned tileZmax, ResolveContext& context, const Dr
 			}
 		}
 		
+		// Edge minimums over a pixel, for trivial accept. The bias absorbs rounding in the per-sample LUT sums.
+		simd_float acceptBias(1.0f / 16.0f);
+		simd_float edge0min = edge0.z + ((edge0.x < simd_float::zero()) & edge0.x) + ((edge0.y < simd_float::zero()) & edge0.y) - acceptBias;
+		simd_float edge1min = edge1.z + ((edge1.x < simd_float::zero()) & edge1.x) + ((edge1.y < simd_float::zero()) & edge1.y) - acceptBias;
+		simd_float edge2min = edge2.z + ((edge2.x < simd_float::zero()) & edge2.x) + ((edge2.y < simd_float::zero()) & edge2.y) - acceptBias;
+
 		// Make conservative.
 		edge0.z += ((edge0.x > simd_float::zero()) & edge0.x) + ((edge0.y > simd_float::zero()) & edge0.y);
 		edge1.z += ((edge1.x > simd_float::zero()) & edge1.x) + ((edge1.y > simd_float::zero()) & edge1.y);
 		edge2.z += ((edge2.x > simd_float::zero()) & edge2.x) + ((edge2.y > simd_float::zero()) & edge2.y);
 
-		for (unsigned p = 0; p < targetPixelCount; ++p) {
+		if (pixelParallel && !longEdges) {
+			resolveBatchPixelParallel<Samples, Color, ZMode, Opaque, ZWrite>(context, edge0, edge1, edge2, edge0min, edge1min, edge2min, z0, z1,
+																	  triangleFragment, triangleZ, laneMask, importantMask, activePixels, LUT0, LUT1, LUT2, LUTZ);
+		}
+		else for (unsigned p = 0; p < targetPixelCount; ++p) {
 			unsigned long long pixelBit = 1ull << (unsigned long long)p;
 
 			if (Opaque && ZWrite) {
@@ -738,7 +1514,7 @@ static void resolveDrawCall(unsigned tileZmax, ResolveContext& context, const Dr
 
 			float pixelZmax = targetPixelSamples[p].zmax;
 
-			if (pixelSampleMask == (1 << samplesPerPixel)-1) {
+			if (pixelSampleMask == Samples::mask) {
 				simd_float tz;
 				tz.load(triangleZ);
 
@@ -753,9 +1529,20 @@ static void resolveDrawCall(unsigned tileZmax, ResolveContext& context, const Dr
 
 			simd_float2 topLeft(simd_float::broadcast_load(targetPixelsX+p), simd_float::broadcast_load(targetPixelsY+p));
 
-			simd_float tl0 = mad(edge0.x, topLeft.x, edge0.y*topLeft.y);
-			simd_float tl1 = mad(edge1.x, topLeft.x, edge1.y*topLeft.y);
-			simd_float tl2 = mad(edge2.x, topLeft.x, edge2.y*topLeft.y);
+			simd_float tl0, tl1, tl2;
+
+			if (longEdges) {
+				simd_double pxd(targetPixelsX[p]), pyd(targetPixelsY[p]);
+
+				tl0 = double2float(clampEdge(mad(e0xl, pxd, mad(e0yl, pyd, e0cl))), clampEdge(mad(e0xh, pxd, mad(e0yh, pyd, e0ch))));
+				tl1 = double2float(clampEdge(mad(e1xl, pxd, mad(e1yl, pyd, e1cl))), clampEdge(mad(e1xh, pxd, mad(e1yh, pyd, e1ch))));
+				tl2 = double2float(clampEdge(mad(e2xl, pxd, mad(e2yl, pyd, e2cl))), clampEdge(mad(e2xh, pxd, mad(e2yh, pyd, e2ch))));
+			}
+			else {
+				tl0 = mad(edge0.x, topLeft.x, edge0.y*topLeft.y);
+				tl1 = mad(edge1.x, topLeft.x, edge1.y*topLeft.y);
+				tl2 = mad(edge2.x, topLeft.x, edge2.y*topLeft.y);
+			}
 			
 			simd_float cd0 = tl0 + edge0.z;
 			simd_float cd1 = tl1 + edge1.z;
@@ -766,6 +1553,9 @@ static void resolveDrawCall(unsigned tileZmax, ResolveContext& context, const Dr
 			if (!pixelMask)
 				continue;
 			
+			// Triangles with all edges positive at every pixel corner cover all samples.
+			unsigned fullyCoveredMask = pixelMask & ~mask((tl0 + edge0min) | (tl1 + edge1min) | (tl2 + edge2min));
+			
 			SRAST_SIMD_ALIGNED float tl0a[simd_float::width];
 			SRAST_SIMD_ALIGNED float tl1a[simd_float::width];
 			SRAST_SIMD_ALIGNED float tl2a[simd_float::width];
@@ -786,115 +1576,276 @@ static void resolveDrawCall(unsigned tileZmax, ResolveContext& context, const Dr
 			do {
 				unsigned tri = __builtin_ctz(pixelMask);
 				pixelMask &= pixelMask-1;
-				
-				simd_float zmax = pixelZmax;
-				
-				if (pixelSampleMask == (1 << samplesPerPixel)-1 && ZMode::less(pixelZmax, triangleZ[tri]))
-					continue;
-
-				simd_float tl0 = simd_float::broadcast_load(tl0a+tri);
-				simd_float tl1 = simd_float::broadcast_load(tl1a+tri);
-				simd_float tl2 = simd_float::broadcast_load(tl2a+tri);
-				simd_float tlz = simd_float::broadcast_load(tlza+tri);
-				
-				unsigned triangleSampleMask = 0;
 
-				for (unsigned s = 0; s < samplesPerPixel; s += simd_float::width) {
-					unsigned lutIdx = tri*samplesPerPixel + s;
-
-					simd_float lut0, lut1, lut2, lutz;
-
-					lut0.load(&LUT0[lutIdx]);
-					lut1.load(&LUT1[lutIdx]);
-					lut2.load(&LUT2[lutIdx]);
-					lutz.load(&LUTZ[lutIdx]);
-
-					simd_float d0 = lut0 + tl0;
-					simd_float d1 = lut1 + tl1;
-					simd_float d2 = lut2 + tl2;
-					simd_float z = lutz + tlz;
+				resolveTrianglePixel<Samples, Color, ZMode, Opaque, ZWrite>(targetPixelSamples[p], pixelSampleMask, pixelZmax, p, tri, triangleFragment[tri], triangleZ[tri], ((fullyCoveredMask >> tri) & 1) != 0,
+					tl0a, tl1a, tl2a, tlza, tri, LUT0, LUT1, LUT2, LUTZ);
+			}
+			while (pixelMask);
 
-					simd_float oldZ;
-					oldZ.load(&targetPixelSamples[p].z[s]);
+			if (Opaque)
+				targetPixelSamples[p].sampleMask = pixelSampleMask;
+			
+			if (ZWrite)
+				targetPixelSamples[p].zmax = pixelZmax;
+		}
 
-					simd_float sampleMask = not_and(d0 | d1 | d2, ZMode::test(z, oldZ));
+		if (Oit)
+			gatherOitFragments<Samples, Color, ZMode>(context, drawCalls, triangleFragment);
+		else if (!Opaque)
+			gatherBlendFragments(context, drawCalls, triangleFragment);
 
-					if (ZWrite) {
-						blend(oldZ, z, sampleMask).store(&targetPixelSamples[p].z[s]);
-						zmax = blend(zmax, ZMode::max(z, zmax), sampleMask);
-					}
+		if (Opaque && ZWrite) {
+			if (!activePixels)
+				break;
+		}
+	}
+}
 
-					triangleSampleMask |= mask(sampleMask) << s;
-				}
-				
-				if (Opaque)
-					pixelSampleMask |= triangleSampleMask;
-				
-				if (ZWrite)
-					pixelZmax = ZMode::max_reduce(zmax).first_float();
+// Depth behind which triangles fail the depth test in every pixel of the tile.
+template<class Samples, class Color, class ZMode>
+static unsigned tileCullDepth(const ResolveContext<Samples, Color>& context, unsigned tileZmax) {
+	float farthest = SRAST_NEAR_Z;
 
-				if (triangleSampleMask) {
-					unsigned fragmentCount = targetPixelSamples[p].fragmentCount;
-					unsigned long long* fragments = targetPixelSamples[p].fragments;
+	for (unsigned i = 0; i < context.targetPixelCount; ++i) {
+		const PixelSamples<Samples, Color>& samples = context.targetPixelSamples[i];
 
-					if (Opaque) {
-						unsigned long long f = (triangleSampleMask | (p << 16)) | triangleFragment[tri];
-						unsigned long long sc = ~((unsigned long long)triangleSampleMask);
+		if (samples.sampleMask != Samples::mask)
+			return tileZmax;
 
-						unsigned i = 0;
+		if (ZMode::less(farthest, samples.zmax))
+			farthest = samples.zmax;
+	}
 
-						for (; i < fragmentCount; ++i) {
-							if (((fragments[i] &= sc) & 0xffff) == 0) {
-								fragments[i] = f;
-								f = 0;
-							}
-						}
+	unsigned z = float_as_uint32(farthest);
+	return ZMode::less(z, tileZmax) ? z : tileZmax;
+}
 
-						if (f) {
-							fragments[fragmentCount++] = f;
-							targetPixelSamples[p].fragmentCount = fragmentCount;
-						}
-					}
-					else {
-						// Note: Custom fragment for shade and blend.
-						unsigned long long f = tri | ((unsigned long long)(triangleSampleMask | (p << 16)) << 24);
+/*
+ Reads the triangles of a draw call, and following draw calls that can share the pass, from the bin.
+ They are resolved in chunks of up to maxTrianglesPerChunk triangles, which refer to their draw call
+ and triangle by slot. Each chunk is culled against the depth of the tile as resolved so far, then
+ sorted for occlusion culling.
+*/
+template<class Samples, class Color, class ZMode, bool Opaque, bool ZWrite, bool Oit>
+static void resolveDrawCall(unsigned tileZmax, ResolveContext<Samples, Color>& context, const DrawCall* __restrict drawCalls, unsigned startDrawCallIdx, CompositeBinList& bin, unsigned& idx) {
+	static const unsigned maxTrianglesPerChunk = ResolveContext<Samples, Color>::maxTrianglesPerChunk;
+	
+	unsigned currentDrawCall = startDrawCallIdx;
 
-						fragments[fragmentCount++] = f;
-						targetPixelSamples[p].fragmentCount = fragmentCount;
+	FragmentRenderState fragmentRenderState = drawCalls[startDrawCallIdx].fragmentRenderState;
+	
+	BinnedTriangle* __restrict triangles = context.triangles;
+	ChunkTriangle* __restrict chunkTriangles = context.chunkTriangles;
+	bool skipDrawCall = false;
+	bool chunkFull;
+	
+	do {
+		unsigned cullZ = tileCullDepth<Samples, Color, ZMode>(context, tileZmax);
+		unsigned triangleCount = 0;
+		
+		chunkFull = false;
+		
+		for (;;) {
+			for (;;) {
+				idx = bin.next();
+				
+				if (idx & 0x80000000)
+					break;
+				
+				if (Oit && skipDrawCall)
+					continue;
+				
+				BinnedTriangle tri = {
+					triangleCount,
+					bin.depth(),
+				};
+				
+				if (ZMode::less(tri.z, cullZ)) {
+					ChunkTriangle chunkTriangle = {
+						currentDrawCall,
+						idx,
+					};
+					
+					chunkTriangles[triangleCount] = chunkTriangle;
+					triangles[triangleCount++] = tri;
+					
+					if (triangleCount == maxTrianglesPerChunk) {
+						// The draw call continues in the next chunk.
+						chunkFull = true;
+						break;
 					}
 				}
 			}
-			while (pixelMask);
-
-			if (Opaque)
-				targetPixelSamples[p].sampleMask = pixelSampleMask;
 			
-			if (ZWrite)
-				targetPixelSamples[p].zmax = pixelZmax;
+			if (chunkFull)
+				break;
+			
+			if (!Opaque && !Oit) // Can only handle one draw call at a time if blending is active.
+				break;
+			
+			unsigned drawCallIndex = idx & (~0x80000000);
+			
+			if (drawCallIndex == 0x0fffffff)
+				break;
+			
+			if (Oit) {
+				// Any order-independent draw call can join. The others were resolved in the first pass.
+				skipDrawCall = !isOrderIndependent(drawCalls[drawCallIndex].fragmentRenderState);
+				
+				if (skipDrawCall)
+					continue;
+			}
+			else if (fragmentRenderState != drawCalls[drawCallIndex].fragmentRenderState)
+				break;
+			
+			currentDrawCall = drawCallIndex;
 		}
+		
+		resolveTriangles<Samples, Color, ZMode, Opaque, ZWrite, Oit>(context, drawCalls, triangleCount);
+	}
+	while (chunkFull);
+	
+	if (!Opaque && !Oit)
+		blendFragments(context, drawCalls);
+}
 
-		if (!Opaque)
-			shadeFragmentsAndBlend(context, drawCalls, triangleFragment);
+// Averages the samples of a pixel.
+template<class Samples>
+static unsigned resolvePixel(const PixelSamples<Samples, ColorRgba8>& pixel) {
+	__m128i pixelColor = _mm_setzero_si128();
+	
+	if (pixel.colorCount) {
+		for (unsigned j = 0; j < pixel.colorCount; ++j) {
+			__m128i color = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(pixel.colors[j]));
+			pixelColor = _mm_add_epi32(pixelColor, _mm_mullo_epi32(color, _mm_set1_epi32(bitCount(pixel.colorMasks[j]))));
+		}
+	}
+	else if (Samples::count == 1) {
+		pixelColor = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(pixel.c[0]));
+	}
+	else {
+		for (unsigned s = 0; s < Samples::count; s += 4) {
+			__m128i samples = _mm_load_si128(reinterpret_cast<const __m128i*>(&pixel.c[s]));
+		
+			__m128i sample0 = _mm_cvtepu8_epi32(samples);
+			__m128i sample1 = _mm_cvtepu8_epi32(_mm_srli_si128(samples, 4));
+			__m128i sample2 = _mm_cvtepu8_epi32(_mm_srli_si128(samples, 8));
+			__m128i sample3 = _mm_cvtepu8_epi32(_mm_srli_si128(samples, 12));
+		
+			sample0 = _mm_add_epi32(sample0, sample1);
+			sample2 = _mm_add_epi32(sample2, sample3);
+		
+			pixelColor = _mm_add_epi32(pixelColor, sample0);
+			pixelColor = _mm_add_epi32(pixelColor, sample2);
+		}
+	}
+	
+	pixelColor = _mm_srli_epi32(pixelColor, Samples::log2);
+	pixelColor = _mm_packus_epi32(pixelColor, pixelColor);
+	pixelColor = _mm_packus_epi16(pixelColor, pixelColor);
+	return _mm_cvtsi128_si32(pixelColor);
+}
 
-		if (Opaque && ZWrite) {
-			if (!activePixels)
-				break;
+template<class Samples, class Color>
+static typename Color::Type resolvePixel(const PixelSamples<Samples, Color>& pixel) {
+	__m128 pixelColor = _mm_setzero_ps();
+	
+	if (pixel.colorCount) {
+		for (unsigned j = 0; j < pixel.colorCount; ++j)
+			pixelColor = _mm_add_ps(pixelColor, _mm_mul_ps(Color::load(pixel.colors[j]), _mm_set1_ps((float)bitCount(pixel.colorMasks[j]))));
+	}
+	else {
+		for (unsigned s = 0; s < Samples::count; ++s)
+			pixelColor = _mm_add_ps(pixelColor, Color::load(pixel.c[s]));
+	}
+	
+	return Color::store(_mm_mul_ps(pixelColor, _mm_set1_ps(1.0f / Samples::count)));
+}
+
+// Nearest and farthest depth over the samples of a pixel.
+template<class Samples, class ZMode, class Color>
+static inline SRAST_FORCEINLINE void pixelDepthRange(const PixelSamples<Samples, Color>& pixel, float& nearest, float& farthest) {
+	if (Samples::count >= simd_float::width) {
+		simd_float zmin;
+		zmin.load(pixel.z);
+		simd_float zmax = zmin;
+
+		for (unsigned s = simd_float::width; s < Samples::count; s += simd_float::width) {
+			simd_float z;
+			z.load(pixel.z + s);
+			zmin = ZMode::min(zmin, z);
+			zmax = ZMode::max(zmax, z);
+		}
+
+		nearest = ZMode::min_reduce(zmin).first_float();
+		farthest = ZMode::max_reduce(zmax).first_float();
+	}
+	else {
+		nearest = pixel.z[0];
+		farthest = pixel.z[0];
+
+		for (unsigned s = 1; s < Samples::count; ++s) {
+			if (ZMode::less(pixel.z[s], nearest))
+				nearest = pixel.z[s];
+
+			if (ZMode::less(farthest, pixel.z[s]))
+				farthest = pixel.z[s];
 		}
 	}
 }
 
-void resolveTile(Renderer& r, unsigned tx, unsigned ty, unsigned thread) {
+static unsigned depthComponents(DEPTHBUFFERFORMAT format) {
+	return format == DEPTHBUFFERFORMAT_Z32F_RANGE ? 2 : 1;
+}
+
+template<class Samples, class Color>
+void resolveTileInMode(Renderer& r, unsigned tx, unsigned ty, unsigned thread) {
 	if (!r.importanceMap.isSet(tileSizeLog2, tx, ty))
 		return;
 
-	unsigned width = r.frameBufferWidth;
-	unsigned height = r.frameBufferHeight;
+	unsigned width = r.regionWidth;
+	unsigned height = r.regionHeight;
 	
 	static const int halfTile = 1 << (tileSizeLog2-1);
 
-	ResolveContext* context = static_cast<ResolveContext*>(r.localAllocators[thread]->allocateTemporary(sizeof(ResolveContext)));
+	ResolveContext<Samples, Color>* context = static_cast<ResolveContext<Samples, Color>*>(r.resolveContexts[thread]);
+
+	if (!context) {
+		typedef ResolveContext<Samples, Color> Context;
+		ThreadLocalAllocator* allocator = r.localAllocators[thread];
+
+		context = static_cast<Context*>(allocator->allocate(sizeof(Context)));
+		context->oitFragments = 0;
+		context->spillColors = 0;
+		context->shadedFragments = Context::maxFragments;
+
+		if (r.resolveBlended && context->shadedFragments < Context::maxBatchFragments)
+			context->shadedFragments = Context::maxBatchFragments;
+
+		if (r.resolveOit) {
+			unsigned n = Context::maxOitFragments;
+			char* memory = static_cast<char*>(allocator->allocate(n*(2*sizeof(unsigned long long) + sizeof(typename Color::Type) + 2*sizeof(float))));
+
+			context->oitFragments = reinterpret_cast<unsigned long long*>(memory);
+			context->oitTailFragments = context->oitFragments + n;
+			context->oitColors = reinterpret_cast<typename Color::Type*>(context->oitTailFragments + n);
+			context->oitDepths = reinterpret_cast<float*>(context->oitColors + n);
+			context->oitTailDepths = context->oitDepths + n;
+
+			if (context->shadedFragments < n)
+				context->shadedFragments = n;
+		}
+
+		// Pixels with no more samples than colors never spill.
+		if (!r.depthOnly && Samples::count > PixelSamples<Samples, Color>::maxColors)
+			context->spillColors = static_cast<typename Color::Type*>(allocator->allocate((Samples::stride << (tileSizeLog2 + tileSizeLog2))*sizeof(typename Color::Type)));
+
+		context->inAttributes = static_cast<float*>(allocator->allocate(context->shadedFragments*r.resolveInAttributeStride));
+		context->outAttributes = static_cast<float*>(allocator->allocate(context->shadedFragments*r.resolveOutAttributeStride));
+		r.resolveContexts[thread] = context;
+	}
 	
-	PixelSamples* __restrict targetPixelSamples = context->targetPixelSamples;
+	PixelSamples<Samples, Color>* __restrict targetPixelSamples = context->targetPixelSamples;
 	unsigned* __restrict targetPixels = context->targetPixels;
 	float* __restrict targetPixelsX = context->targetPixelsX;
 	float* __restrict targetPixelsY = context->targetPixelsY;
@@ -915,11 +1866,17 @@ void resolveTile(Renderer& r, unsigned tx, unsigned ty, unsigned thread) {
 	context->tileY = (int)ty+halfTile - height*0.5f;
 	context->halfWidth = 0.5f*width;
 	context->halfHeight = 0.5f*height;
+	context->thread = thread;
+	context->attributeStamp = r.stateStamp;
+	context->blendFragmentCount = 0;
+	context->drawCallCount = (unsigned)r.drawCalls.size();
+	context->oitTailCount = 0;
+	context->samplePattern = r.samplePattern;
 	
-	simd_float cClear = _mm_castsi128_ps(_mm_set1_epi32(r.clearColor));
 	simd_float zClear(SRAST_FAR_Z);
 
 	unsigned earlyOut = r.dense ? 0 : 1;
+	typename Color::Type clearColor = Color::clearColor(r.clearColor, r.clearColorFloat);
 
 	for (unsigned i = 0; i < targetPixelCount; ++i) {
 		targetPixelSamples[i].zmax = SRAST_NEAR_Z;
@@ -927,11 +1884,14 @@ void resolveTile(Renderer& r, unsigned tx, unsigned ty, unsigned thread) {
 		targetPixelSamples[i].sampleMask = 0;
 		targetPixelSamples[i].isImportant = 0;
 		targetPixelSamples[i].earlyOut = earlyOut;
+		targetPixelSamples[i].colorCount = 1;
+		targetPixelSamples[i].colors[0] = clearColor;
+		targetPixelSamples[i].colorMasks[0] = Samples::mask;
+		targetPixelSamples[i].c = context->spillColors ? context->spillColors + i*Samples::stride : 0;
+		context->oitCounts[i] = 0;
 
-		for (unsigned s = 0; s < samplesPerPixel; s += simd_float::width) {
-			cClear.store(reinterpret_cast<float*>(&targetPixelSamples[i].c[s]));
+		for (unsigned s = 0; s < Samples::stride; s += simd_float::width)
 			zClear.store(&targetPixelSamples[i].z[s]);
-		}
 	}
 
 	CompositeBinList& bin = r.compositeBinListArray[thread];
@@ -940,17 +1900,48 @@ void resolveTile(Renderer& r, unsigned tx, unsigned ty, unsigned thread) {
 	unsigned idx = bin.next();
 	bool isShaded = true;
 
-	while (idx != 0x8fffffff) {
+	// Order-independent draw calls are skipped in the first pass and resolved in a second.
+	bool oitPass = false;
+	bool hasOit = false;
+
+	for (;;) {
+		if (idx == 0x8fffffff) {
+			if (oitPass || !hasOit)
+				break;
+			
+			oitPass = true;
+			bin.setup(r.poolAllocator, r.binListArray, tx, ty, r.frameNumber);
+			idx = bin.next();
+			continue;
+		}
+		
 		unsigned i = idx & (~0x80000000);
 		const DrawCall& drawCall = r.drawCalls[i];
+		
+		bool oit = !r.depthOnly && r.orderIndependentTransparency && isOrderIndependent(drawCall.fragmentRenderState);
+		
+		// Draw calls without depth write do nothing in depth-only mode.
+		if (oit != oitPass || (r.depthOnly && !drawCall.fragmentRenderState.getDepthWrite())) {
+			hasOit |= oit;
+			
+			do {
+				idx = bin.next();
+			}
+			while (!(idx & 0x80000000));
+			
+			continue;
+		}
 
-		if (drawCall.fragmentRenderState.isOpaque()) {
+		if (r.depthOnly) {
+			resolveDrawCall<Samples, Color, ZLessMode, true, true, false>(tileZmax, *context, &r.drawCalls[0], i, bin, idx);
+		}
+		else if (drawCall.fragmentRenderState.isOpaque()) {
 			isShaded = false;
 			
 			if (drawCall.fragmentRenderState.getDepthWrite())
-				resolveDrawCall<ZLessMode, true, true>(tileZmax, *context, &r.drawCalls[0], i, bin, idx, r.clearColor);
+				resolveDrawCall<Samples, Color, ZLessMode, true, true, false>(tileZmax, *context, &r.drawCalls[0], i, bin, idx);
 			else
-				resolveDrawCall<ZLessMode, true, false>(tileZmax, *context, &r.drawCalls[0], i, bin, idx, r.clearColor);
+				resolveDrawCall<Samples, Color, ZLessMode, true, false, false>(tileZmax, *context, &r.drawCalls[0], i, bin, idx);
 		}
 		else {
 			if (!r.transparentImportance) {
@@ -990,17 +1981,37 @@ void resolveTile(Renderer& r, unsigned tx, unsigned ty, unsigned thread) {
 			}
 
 			if (drawCall.fragmentRenderState.getDepthWrite())
-				resolveDrawCall<ZLessMode, false, true>(tileZmax, *context, &r.drawCalls[0], i, bin, idx, r.clearColor);
+				resolveDrawCall<Samples, Color, ZLessMode, false, true, false>(tileZmax, *context, &r.drawCalls[0], i, bin, idx);
+			else if (oit)
+				resolveDrawCall<Samples, Color, ZLessMode, false, false, true>(tileZmax, *context, &r.drawCalls[0], i, bin, idx);
 			else
-				resolveDrawCall<ZLessMode, false, false>(tileZmax, *context, &r.drawCalls[0], i, bin, idx, r.clearColor);
+				resolveDrawCall<Samples, Color, ZLessMode, false, false, false>(tileZmax, *context, &r.drawCalls[0], i, bin, idx);
 		}
 	}
 	
-	if (!isShaded)
+	if (oitPass)
+		compositeOit<Samples, Color, ZLessMode>(*context, &r.drawCalls[0]);
+
+	if (r.depthOnly) {
+		// Nothing is shaded, so covered pixels are resolved here.
+		for (unsigned i = 0; i < targetPixelCount; ++i) {
+			if (targetPixelSamples[i].fragmentCount)
+				targetPixelSamples[i].earlyOut = 0;
+		}
+	}
+	else if (!isShaded)
 		shadeTile(*context, &r.drawCalls[0], true);
 	
-	unsigned* pixels = static_cast<unsigned*>(r.frameBuffer);
 	unsigned pitch = r.frameBufferPitch;
+	typename Color::Type* pixels = static_cast<typename Color::Type*>(r.frameBuffer) + (r.frameBufferHeight - r.regionY - height)*pitch + r.regionX;
+
+	unsigned depthPitch = 0;
+	float* depths = 0;
+	
+	if (r.depthBuffer) {
+		depthPitch = r.depthBufferPitch * depthComponents(r.depthBufferFormat);
+		depths = static_cast<float*>(r.depthBuffer) + (r.frameBufferHeight - r.regionY - height)*depthPitch + r.regionX*depthComponents(r.depthBufferFormat);
+	}
 
 	for (unsigned i = 0; i < targetPixelCount; ++i) {
 		if (targetPixelSamples[i].earlyOut) {
@@ -1009,32 +2020,131 @@ void resolveTile(Renderer& r, unsigned tx, unsigned ty, unsigned thread) {
 			r.importanceMap.setTo(x, y, tileSizeLog2);
 			continue;
 		}
+
+		unsigned x = targetPixels[i] & 0xffff;
+		unsigned y = targetPixels[i] >> 16;
+
+		if (!r.depthOnly)
+			pixels[(height-y-1)*pitch + x] = resolvePixel(targetPixelSamples[i]);
+
+		if (depths) {
+			float nearest, farthest;
+			pixelDepthRange<Samples, ZLessMode>(targetPixelSamples[i], nearest, farthest);
+
+			float* depth = depths + (height-y-1)*depthPitch + x*depthComponents(r.depthBufferFormat);
+			depth[0] = nearest;
+
+			if (r.depthBufferFormat == DEPTHBUFFERFORMAT_Z32F_RANGE)
+				depth[1] = farthest;
+		}
+	}
+}
+
+template<class Color>
+static void resolveTileInFormat(Renderer& r, unsigned samplesPerPixelLog2, unsigned tx, unsigned ty, unsigned thread) {
+	switch (samplesPerPixelLog2) {
+		case 0:
+			resolveTileInMode<SampleCount<0>, Color>(r, tx, ty, thread);
+			break;
+		case 2:
+			resolveTileInMode<SampleCount<2>, Color>(r, tx, ty, thread);
+			break;
+		case 3:
+			resolveTileInMode<SampleCount<3>, Color>(r, tx, ty, thread);
+			break;
+		default:
+			resolveTileInMode<SampleCount<4>, Color>(r, tx, ty, thread);
+			break;
+	}
+}
+
+void resolveTile(Renderer& r, unsigned tx, unsigned ty, unsigned thread) {
+	switch (r.frameBufferFormat) {
+		case FRAMEBUFFERFORMAT_RGBA16F:
+			resolveTileInFormat<ColorRgba16f>(r, r.samplesPerPixelLog2, tx, ty, thread);
+			break;
+		case FRAMEBUFFERFORMAT_RGBA32F:
+			resolveTileInFormat<ColorRgba32f>(r, r.samplesPerPixelLog2, tx, ty, thread);
+			break;
+		default:
+			resolveTileInFormat<ColorRgba8>(r, r.samplesPerPixelLog2, tx, ty, thread);
+			break;
+	}
+}
+
+
+template<class Type>
+static void fillPixels(void* buffer, unsigned pitch, unsigned x0, unsigned x1, unsigned y0, unsigned y1, Type value) {
+	Type* pixels = static_cast<Type*>(buffer);
+	
+	for (unsigned y = y0; y < y1; ++y)
+		std::fill(pixels + y*pitch + x0, pixels + y*pitch + x1, value);
+}
+
+void clearEmptyTiles(Renderer& r, const unsigned char* tileClass, unsigned ty) {
+	unsigned width = r.regionWidth;
+	unsigned height = r.regionHeight;
+	unsigned tileWidth = (width + (1<<tileSizeLog2)-1) >> tileSizeLog2;
+	unsigned y1 = std::min(height, ty + (1<<tileSizeLog2));
+	
+	const unsigned char* rowClass = tileClass + (ty >> tileSizeLog2)*tileWidth;
+	
+	unsigned pitch = r.frameBufferPitch;
+	
+	for (unsigned i = 0; i < tileWidth;) {
+		if (rowClass[i]) {
+			++i;
+			continue;
+		}
 		
-		__m128i pixelColor = _mm_setzero_si128();
+		unsigned runStart = i;
 		
-		for (unsigned s = 0; s < samplesPerPixel; s += 4) {
-			__m128i samples = _mm_load_si128(reinterpret_cast<const __m128i*>(&targetPixelSamples[i].c[s]));
-			
-			__m128i sample0 = _mm_cvtepu8_epi32(samples);
-			__m128i sample1 = _mm_cvtepu8_epi32(_mm_srli_si128(samples, 4));
-			__m128i sample2 = _mm_cvtepu8_epi32(_mm_srli_si128(samples, 8));
-			__m128i sample3 = _mm_cvtepu8_epi32(_mm_srli_si128(samples, 12));
+		while (i < tileWidth && !rowClass[i])
+			++i;
+		
+		unsigned x0 = runStart << tileSizeLog2;
+		unsigned x1 = std::min(width, i << tileSizeLog2);
+		
+		if (r.dense) {
+			// Rows are stored bottom up.
+			unsigned fx0 = r.regionX + x0;
+			unsigned fx1 = r.regionX + x1;
+			unsigned fy0 = r.frameBufferHeight - r.regionY - y1;
+			unsigned fy1 = r.frameBufferHeight - r.regionY - ty;
 			
-			sample0 = _mm_add_epi32(sample0, sample1);
-			sample2 = _mm_add_epi32(sample2, sample3);
+			if (!r.depthOnly) {
+				switch (r.frameBufferFormat) {
+					case FRAMEBUFFERFORMAT_RGBA16F:
+						fillPixels(r.frameBuffer, pitch, fx0, fx1, fy0, fy1, ColorRgba16f::clearColor(r.clearColor, r.clearColorFloat));
+						break;
+					case FRAMEBUFFERFORMAT_RGBA32F:
+						fillPixels(r.frameBuffer, pitch, fx0, fx1, fy0, fy1, ColorRgba32f::clearColor(r.clearColor, r.clearColorFloat));
+						break;
+					default:
+						fillPixels(r.frameBuffer, pitch, fx0, fx1, fy0, fy1, r.clearColor);
+						break;
+				}
+			}
 			
-			pixelColor = _mm_add_epi32(pixelColor, sample0);
-			pixelColor = _mm_add_epi32(pixelColor, sample2);
+			if (r.depthBuffer) {
+				unsigned components = depthComponents(r.depthBufferFormat);
+				fillPixels(r.depthBuffer, r.depthBufferPitch*components, fx0*components, fx1*components, fy0, fy1, SRAST_FAR_Z);
+			}
+		}
+		else {
+			// Nothing covers the important pixels of an empty tile, so they all early-out.
+			for (unsigned tx = x0; tx < x1; tx += 1<<tileSizeLog2) {
+				if (!r.importanceMap.isSet(tileSizeLog2, tx, ty))
+					continue;
+				
+				for (unsigned y = ty; y < y1; ++y) {
+					for (unsigned x = tx; x < x1 && x < tx + (1<<tileSizeLog2); ++x) {
+						if (r.importanceMap.isSet(0, x, y))
+							r.importanceMap.setTo(x, y, tileSizeLog2);
+					}
+				}
+			}
 		}
-		
-		pixelColor = _mm_srli_epi32(pixelColor, samplesPerPixelLog2);
-		pixelColor = _mm_packus_epi32(pixelColor, pixelColor);
-		pixelColor = _mm_packus_epi16(pixelColor, pixelColor);
-
-		unsigned x = targetPixels[i] & 0xffff;
-		unsigned y = targetPixels[i] >> 16;
-
-		pixels[(height-y-1)*pitch + x] = _mm_cvtsi128_si32(pixelColor);
 	}
 }
 
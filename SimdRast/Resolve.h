@@ -15,6 +15,8 @@ namespace srast {
 
 void resolveTile(Renderer& r, unsigned tx, unsigned ty, unsigned thread);
 
+void clearEmptyTiles(Renderer& r, const unsigned char* tileClass, unsigned ty);
+
 }
 
 #endif
@@ -238,6 +238,16 @@ inline simd4_float double2float(const simd2_double& lo, const simd2_double& hi)
 	return _mm_shuffle_ps(_mm_cvtpd_ps(lo.mm), _mm_cvtpd_ps(hi.mm), _MM_SHUFFLE(1,0,1,0));
 }
 
+inline simd2_double int64_to_double(__m128i v) { // Exact for |v| < 2^51.
+	__m128d magic = _mm_set1_pd(6755399441055744.0); // 2^52 + 2^51
+	return _mm_sub_pd(_mm_castsi128_pd(_mm_add_epi64(v, _mm_castpd_si128(magic))), magic);
+}
+
+inline __m128i double_to_int64(const simd2_double& v) { // Exact for integers |v| < 2^51.
+	__m128d magic = _mm_set1_pd(6755399441055744.0);
+	return _mm_sub_epi64(_mm_castpd_si128(_mm_add_pd(v.mm, magic)), _mm_castpd_si128(magic));
+}
+
 #define SRAST_MM_TRANSPOSE2_PD(row0, row1) \
 do {\
 __m128d tmp0 = _mm_unpacklo_pd((row0), (row1));\
@@ -286,6 +286,14 @@ inline simd4_float simd_float_add_exp(const simd4_float& x, unsigned y) {
 	return _mm_castsi128_ps(bits);
 }
 
+inline simd4_float int32_to_float(const simd4_float& v) { // Converts integers stored in the float bits.
+	return _mm_cvtepi32_ps(_mm_castps_si128(v.mm));
+}
+
+inline simd4_float float_to_int32(const simd4_float& v) { // Rounds to nearest and stores the integers in the float bits.
+	return _mm_castsi128_ps(_mm_cvtps_epi32(v.mm));
+}
+
 inline simd4_float next_after(const simd4_float& x) { // The next representable float.
 	// Note: Does handle fraction overflow automatically.
 	// Note: Does NOT handle NaN/Inf.
@@ -379,6 +387,78 @@ inline void simd_float_store_rgba(const simd4_float& r, const simd4_float& g, co
 	_mm_store_si128(reinterpret_cast<__m128i*>(output), mi0);
 }
 
+// Converts four floats to halves in the low 64 bits, rounding to nearest even.
+inline __m128i simd_float_to_half(__m128 f) {
+#ifdef SRAST_F16C
+	return _mm_cvtps_ph(f, 0);
+#else
+	__m128i sign = _mm_and_si128(_mm_castps_si128(f), _mm_set1_epi32(0x80000000));
+	__m128i absf = _mm_xor_si128(_mm_castps_si128(f), sign);
+	
+	// Subnormal halves are rounded by the float addition, normal ones by adding the bias and half an ulp.
+	__m128i subnormalMagic = _mm_set1_epi32(((127-15) + (23-10) + 1) << 23);
+	__m128i subnormal = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(absf), _mm_castsi128_ps(subnormalMagic))), subnormalMagic);
+	
+	__m128i odd = _mm_srai_epi32(_mm_slli_epi32(absf, 31-13), 31);
+	__m128i normal = _mm_srli_epi32(_mm_sub_epi32(_mm_add_epi32(absf, _mm_set1_epi32(0xfff - ((127-15) << 23))), odd), 13);
+	
+	__m128i isSubnormal = _mm_cmpgt_epi32(_mm_set1_epi32((127-14) << 23), absf);
+	__m128i finite = _mm_blendv_epi8(normal, subnormal, isSubnormal);
+	
+	// Overflow goes to infinity, NaN stays NaN.
+	__m128i isNan = _mm_cmpgt_epi32(absf, _mm_set1_epi32(0x7f800000));
+	__m128i special = _mm_or_si128(_mm_set1_epi32(0x7c00), _mm_and_si128(isNan, _mm_set1_epi32(0x200)));
+	__m128i isFinite = _mm_cmpgt_epi32(_mm_set1_epi32((127+16) << 23), absf);
+	__m128i result = _mm_or_si128(_mm_blendv_epi8(special, finite, isFinite), _mm_srai_epi32(sign, 16));
+	
+	return _mm_packs_epi32(result, result);
+#endif
+}
+
+// Converts four halves in the low 64 bits to floats.
+inline __m128 simd_half_to_float(__m128i h) {
+#ifdef SRAST_F16C
+	return _mm_cvtph_ps(h);
+#else
+	h = _mm_cvtepu16_epi32(h);
+	
+	__m128i expmant = _mm_and_si128(h, _mm_set1_epi32(0x7fff));
+	__m128i sign = _mm_slli_epi32(_mm_xor_si128(h, expmant), 16);
+	
+	// Scaling rebiases the exponent and normalizes subnormals.
+	__m128 scaled = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(expmant, 13)), _mm_castsi128_ps(_mm_set1_epi32((254-15) << 23)));
+	__m128i infNan = _mm_and_si128(_mm_cmpgt_epi32(expmant, _mm_set1_epi32(0x7bff)), _mm_set1_epi32(255 << 23));
+	
+	return _mm_or_ps(scaled, _mm_castsi128_ps(_mm_or_si128(sign, infNan)));
+#endif
+}
+
+inline void simd_float_store_rgba16f(const simd4_float& r, const simd4_float& g, const simd4_float& b, const simd4_float& a, unsigned short* output) {
+	__m128 m0 = r.mm;
+	__m128 m1 = g.mm;
+	__m128 m2 = b.mm;
+	__m128 m3 = a.mm;
+	
+	_MM_TRANSPOSE4_PS(m0, m1, m2, m3);
+	
+	_mm_store_si128(reinterpret_cast<__m128i*>(output), _mm_unpacklo_epi64(simd_float_to_half(m0), simd_float_to_half(m1)));
+	_mm_store_si128(reinterpret_cast<__m128i*>(output) + 1, _mm_unpacklo_epi64(simd_float_to_half(m2), simd_float_to_half(m3)));
+}
+
+inline void simd_float_store_rgba32f(const simd4_float& r, const simd4_float& g, const simd4_float& b, const simd4_float& a, float* output) {
+	__m128 m0 = r.mm;
+	__m128 m1 = g.mm;
+	__m128 m2 = b.mm;
+	__m128 m3 = a.mm;
+	
+	_MM_TRANSPOSE4_PS(m0, m1, m2, m3);
+	
+	_mm_store_ps(output + 0, m0);
+	_mm_store_ps(output + 4, m1);
+	_mm_store_ps(output + 8, m2);
+	_mm_store_ps(output + 12, m3);
+}
+
 #ifdef SRAST_AVX
 struct simd8_float {
 	static const int width = 8;
@@ -616,6 +696,14 @@ inline simd8_float max_reduce(const simd8_float& v) {
 	return _mm256_castps128_ps256(a);
 }
 
+inline simd8_float int32_to_float(const simd8_float& v) {
+	return _mm256_cvtepi32_ps(_mm256_castps_si256(v.mm));
+}
+
+inline simd8_float float_to_int32(const simd8_float& v) {
+	return _mm256_castsi256_ps(_mm256_cvtps_epi32(v.mm));
+}
+
 inline simd8_float next_after(const simd8_float& x) {
 	return simd_float_combine(next_after(x.low()).mm, next_after(x.high()).mm);
 }
@@ -857,6 +945,16 @@ inline void simd_float_store_rgba(const simd8_float& r, const simd8_float& g, co
 	_mm_store_si128(reinterpret_cast<__m128i*>(output) + 1, mi0);
 }
 
+inline void simd_float_store_rgba16f(const simd8_float& r, const simd8_float& g, const simd8_float& b, const simd8_float& a, unsigned short* output) {
+	simd_float_store_rgba16f(simd4_float(_mm256_castps256_ps128(r.mm)), simd4_float(_mm256_castps256_ps128(g.mm)), simd4_float(_mm256_castps256_ps128(b.mm)), simd4_float(_mm256_castps256_ps128(a.mm)), output);
+	simd_float_store_rgba16f(simd4_float(_mm256_extractf128_ps(r.mm, 1)), simd4_float(_mm256_extractf128_ps(g.mm, 1)), simd4_float(_mm256_extractf128_ps(b.mm, 1)), simd4_float(_mm256_extractf128_ps(a.mm, 1)), output + 16);
+}
+
+inline void simd_float_store_rgba32f(const simd8_float& r, const simd8_float& g, const simd8_float& b, const simd8_float& a, float* output) {
+	simd_float_store_rgba32f(simd4_float(_mm256_castps256_ps128(r.mm)), simd4_float(_mm256_castps256_ps128(g.mm)), simd4_float(_mm256_castps256_ps128(b.mm)), simd4_float(_mm256_castps256_ps128(a.mm)), output);
+	simd_float_store_rgba32f(simd4_float(_mm256_extractf128_ps(r.mm, 1)), simd4_float(_mm256_extractf128_ps(g.mm, 1)), simd4_float(_mm256_extractf128_ps(b.mm, 1)), simd4_float(_mm256_extractf128_ps(a.mm, 1)), output + 16);
+}
+
 typedef simd8_float simd_float;
 #else
 typedef simd4_float simd_float;
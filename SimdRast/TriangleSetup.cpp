@@ -10,37 +10,46 @@
 #include "IndexProvider.h"
 #include "SimdDouble.h"
 #include "Binning.h"
+#include "Atomics.h"
 #include <new>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
 
 namespace srast {
 
+#ifdef _WIN32
+inline unsigned __builtin_ctz(unsigned x) {
+   DWORD r = 0;
+   _BitScanForward(&r, x);
+   return r;
+}
+#endif
+
 #define GATHER_TRIANGLE(m0, m1, m2, idx) \
 __m128 m0, m1, m2;\
-if (idx == 0 || i + 3*idx < end) {\
-int3 ind = indices(i + 3*idx);\
-m0 = _mm_load_ps(&shadedPositions[ind.x].x);\
-m1 = _mm_load_ps(&shadedPositions[ind.y].x);\
-m2 = _mm_load_ps(&shadedPositions[ind.z].x);\
-laneMask += laneMask + 1;\
+if (laneMask >> idx & 1) {\
+int3 ind = indices(3*triangles[idx]);\
+m0 = _mm_load_ps(positions(idx, 0, ind.x));\
+m1 = _mm_load_ps(positions(idx, 1, ind.y));\
+m2 = _mm_load_ps(positions(idx, 2, ind.z));\
 }
 
 #define GATHER_TRIANGLE_LO(m0, m1, m2, idx) \
 __m256 m0, m1, m2;\
-if (idx == 0 || i + 3*idx < end) {\
-int3 ind = indices(i + 3*idx);\
-m0 = _mm256_castps128_ps256(_mm_load_ps(&shadedPositions[ind.x].x));\
-m1 = _mm256_castps128_ps256(_mm_load_ps(&shadedPositions[ind.y].x));\
-m2 = _mm256_castps128_ps256(_mm_load_ps(&shadedPositions[ind.z].x));\
-laneMask += laneMask + 1;\
+if (laneMask >> idx & 1) {\
+int3 ind = indices(3*triangles[idx]);\
+m0 = _mm256_castps128_ps256(_mm_load_ps(positions(idx, 0, ind.x)));\
+m1 = _mm256_castps128_ps256(_mm_load_ps(positions(idx, 1, ind.y)));\
+m2 = _mm256_castps128_ps256(_mm_load_ps(positions(idx, 2, ind.z)));\
 }
 
 #define GATHER_TRIANGLE_HI(m0, m1, m2, idx) \
-if (idx == 0 || i + 3*idx < end) {\
-int3 ind = indices(i + 3*idx);\
-m0 = _mm256_insertf128_ps(m0, _mm_load_ps(&shadedPositions[ind.x].x), 1);\
-m1 = _mm256_insertf128_ps(m1, _mm_load_ps(&shadedPositions[ind.y].x), 1);\
-m2 = _mm256_insertf128_ps(m2, _mm_load_ps(&shadedPositions[ind.z].x), 1);\
-laneMask += laneMask + 1;\
+if (laneMask >> idx & 1) {\
+int3 ind = indices(3*triangles[idx]);\
+m0 = _mm256_insertf128_ps(m0, _mm_load_ps(positions(idx, 0, ind.x)), 1);\
+m1 = _mm256_insertf128_ps(m1, _mm_load_ps(positions(idx, 1, ind.y)), 1);\
+m2 = _mm256_insertf128_ps(m2, _mm_load_ps(positions(idx, 2, ind.z)), 1);\
 }
 
 inline simd_float3 operator & (const simd_float3& lhs, const simd_float3& rhs) {
@@ -97,10 +106,48 @@ inline simd_float3 not_and(const simd_float3& a, const simd_float3& b) {
 	return simd_float3(not_and(a.x, b.x), not_and(a.y, b.y), not_and(a.z, b.z));
 }
 
+static const float guardband = 4096.0f;
+
+// Exact 2*(x0*y1 - x1*y0) + bias in 1/512 pixels. Coordinates are 28.4 integers stored in the float bits.
+// The bias is -1 for lanes with the sign bit set in fillRule.
+inline void computeEdgeConstant(long long* __restrict c, const simd_float& x0, const simd_float& y0, const simd_float& x1, const simd_float& y1, const simd_float& fillRule) {
+	SRAST_SIMD_ALIGNED int x0a[simd_float::width], y0a[simd_float::width], x1a[simd_float::width], y1a[simd_float::width], fa[simd_float::width];
+
+	x0.store(reinterpret_cast<float*>(x0a));
+	y0.store(reinterpret_cast<float*>(y0a));
+	x1.store(reinterpret_cast<float*>(x1a));
+	y1.store(reinterpret_cast<float*>(y1a));
+	fillRule.store(reinterpret_cast<float*>(fa));
+
+	for (unsigned i = 0; i < simd_float::width; i += 2) {
+		__m128i mx0 = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(x0a+i)));
+		__m128i my0 = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(y0a+i)));
+		__m128i mx1 = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(x1a+i)));
+		__m128i my1 = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(y1a+i)));
+		__m128i bias = _mm_cvtepi32_epi64(_mm_srai_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(fa+i)), 31));
+
+		__m128i ci = _mm_sub_epi64(_mm_mul_epi32(mx0, my1), _mm_mul_epi32(mx1, my0));
+		ci = _mm_add_epi64(_mm_slli_epi64(ci, 1), bias);
+
+		_mm_store_si128(reinterpret_cast<__m128i*>(c+i), ci);
+	}
+}
+
+// Moves a snapped edge out by half a pixel in x and y. Pixel centers are then covered whenever the triangle touches the pixel.
+inline void expandEdgeConstant(long long* __restrict c, const simd_float& a, const simd_float& b) {
+	SRAST_SIMD_ALIGNED int aa[simd_float::width], ba[simd_float::width];
+
+	a.store(reinterpret_cast<float*>(aa));
+	b.store(reinterpret_cast<float*>(ba));
+
+	for (unsigned i = 0; i < simd_float::width; ++i)
+		c[i] += 16ll*(std::abs(aa[i]) + std::abs(ba[i]));
+}
+
 template<bool first>
 inline simd_float4 computeClippedEdge(const simd_float3& v0, const simd_float2& a0, const simd_float3& b0,
 									  const simd_float3& v1, const simd_float2& a1, const simd_float3& b1,
-									  simd_double2& hpez, simd_float4& bb, const simd_float& halfWidth, const simd_float& halfHeight, simd_float3& firstVert) {
+									  simd_float& ea, simd_float& eb, long long* __restrict ec, simd_float4& bb, const simd_float& halfWidth, const simd_float& halfHeight, simd_float3& firstVert, bool conservative) {
 	// Frustum reject.
 	simd_float ww0 = halfWidth * v0.z;
 	simd_float hw0 = halfHeight * v0.z;
@@ -149,12 +196,17 @@ inline simd_float4 computeClippedEdge(const simd_float3& v0, const simd_float2&
 	
 	simd_float w = (p0.z*p1.z) / (simd_float(1.0f)-s0-s1);
 	
-	p0.x = round(p0.x*rz0) * (1.0f / 16.0f);
-	p0.y = round(p0.y*rz0) * (1.0f / 16.0f);
+	simd_float x0 = round(p0.x*rz0);
+	simd_float y0 = round(p0.y*rz0);
+	simd_float x1 = round(p1.x*rz1);
+	simd_float y1 = round(p1.y*rz1);
+
+	p0.x = x0 * (1.0f / 16.0f);
+	p0.y = y0 * (1.0f / 16.0f);
 	p0.z = 1.0f;
 	
-	p1.x = round(p1.x*rz1) * (1.0f / 16.0f);
-	p1.y = round(p1.y*rz1) * (1.0f / 16.0f);
+	p1.x = x1 * (1.0f / 16.0f);
+	p1.y = y1 * (1.0f / 16.0f);
 	p1.z = 1.0f;
 	
 	// Default to homogeneous edge equation if outside.
@@ -168,18 +220,44 @@ inline simd_float4 computeClippedEdge(const simd_float3& v0, const simd_float2&
 	edge.z = p0.x*p1.y - p1.x*p0.y;
 	edge.w = blend(1.0f, w, inside);
 	
+	// Fixed-point edge. Snapped edges are exact. Homogeneous edges only need the right sign on screen,
+	// so they are normalized to max(|a|, |b|) = 4096 pixels and rounded.
+	simd_float scale = blend(simd_float(16.0f*4096.0f) / max(abs(edge.x), abs(edge.y)), 16.0f, inside);
+
+	ea = float_to_int32(edge.x*scale);
+	eb = float_to_int32(edge.y*scale);
+
+	SRAST_SIMD_ALIGNED long long snapped[simd_float::width];
+	SRAST_SIMD_ALIGNED float homogeneous[simd_float::width];
+	SRAST_SIMD_ALIGNED int insideMask[simd_float::width];
+
 	// Top-left fill convention.
-	simd_float offset = blend(0.0f, -1.0f/(16.0f*32.0f), (edge.x | ((edge.x == simd_float::zero()) & edge.y)) & inside);
+	computeEdgeConstant(snapped, float_to_int32(x0), float_to_int32(y0), float_to_int32(x1), float_to_int32(y1),
+						(edge.x | ((edge.x == simd_float::zero()) & edge.y)) & inside);
+
+	simd_float homogeneousC = edge.z*scale*32.0f;
+
+	if (conservative) {
+		// Homogeneous constants are not snapped, so they are moved out with the unrounded edge.
+		expandEdgeConstant(snapped, ea, eb);
+		homogeneousC += scale*(abs(edge.x) + abs(edge.y))*16.0f;
+	}
+
+	min(max(round(homogeneousC), -1125899906842624.0f), 1125899906842624.0f).store(homogeneous); // 2^50
+	inside.store(reinterpret_cast<float*>(insideMask));
+
+	for (unsigned i = 0; i < simd_float::width; i += 2) {
+		__m128i h = double_to_int64(_mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double*>(homogeneous+i)))));
+		__m128i s = _mm_load_si128(reinterpret_cast<const __m128i*>(snapped+i));
+		__m128i m = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(insideMask+i)));
+		_mm_store_si128(reinterpret_cast<__m128i*>(ec+i), _mm_blendv_epi8(h, s, m));
+	}
 
-	// High-precision edge z.
-	hpez.x = float2double_lo(p0.x)*float2double_lo(p1.y) - float2double_lo(p1.x)*float2double_lo(p0.y) + float2double_lo(offset);
-	hpez.y = float2double_hi(p0.x)*float2double_hi(p1.y) - float2double_hi(p1.x)*float2double_hi(p0.y) + float2double_hi(offset);
-	
 	// Bounding box.
 	simd_float signMask(-0.0f);
 	
-	simd_float xc0 = (edge.x & signMask) ^ (-1920.0f);
-	simd_float yc0 = (edge.y & signMask) ^ (-1920.0f);
+	simd_float xc0 = (edge.x & signMask) ^ (-guardband);
+	simd_float yc0 = (edge.y & signMask) ^ (-guardband);
 	
 	simd_float xc1 = blend(xc0, -xc0, b0.z | b1.z); // Cover entire screen if behind view.
 	simd_float yc1 = blend(yc0, -yc0, b0.z | b1.z);
@@ -221,389 +299,597 @@ inline vec2<simd4_float> encodeBoundingBox(const vec4<simd4_float>& bb) {
 	return vec2<simd4_float>(_mm_castsi128_ps(bbxy16), _mm_castsi128_ps(bbzw16));
 }
 
-template<class ZMode, class T>
-static void setupDrawCallTriangles(Renderer& r, DrawCall& drawCall, T indices, unsigned start, unsigned end, unsigned thread) {
-	float4* __restrict shadedPositions = drawCall.shadedPositions;
-	unsigned char* __restrict flags = drawCall.flags + start/3;
+// Setup reads the vertices of a triangle from the shaded positions of the draw call.
+struct ShadedPositions {
+	const float4* __restrict positions;
+	ShadedPositions(const float4* positions) : positions(positions) {}
+	const float* operator () (unsigned, unsigned, unsigned vertex) const {
+		return &positions[vertex].x;
+	}
+};
 
-	for (unsigned i = start; i < end; i += 3*simd_float::width) {
-		unsigned laneMask = 0;
+// With fused vertex shading, the vertices of each lane are read from the vertex cache instead.
+struct CachedPositions {
+	const float4* __restrict positions;
+	const unsigned* __restrict slots;
+	CachedPositions(const float4* positions, const unsigned* slots) : positions(positions), slots(slots) {}
+	const float* operator () (unsigned lane, unsigned corner, unsigned) const {
+		return &positions[slots[3*lane + corner]].x;
+	}
+};
+
+// Sets up one batch of triangles. Returns the lanes that cross the guardband unless Clipped is set.
+template<class ZMode, bool Clipped, class T, class P>
+static unsigned setupTriangleBatch(Renderer& r, DrawCall& drawCall, T indices, P positions, const unsigned* __restrict triangles, unsigned laneMask) {
+	unsigned char* __restrict flags = drawCall.flags;
+	unsigned deferred = 0;
 
 #ifdef SRAST_AVX
-		GATHER_TRIANGLE_LO(m00, m01, m02, 0);
-		GATHER_TRIANGLE_LO(m10, m11, m12, 1);
-		GATHER_TRIANGLE_LO(m20, m21, m22, 2);
-		GATHER_TRIANGLE_LO(m30, m31, m32, 3);
-		
-		GATHER_TRIANGLE_HI(m00, m01, m02, 4);
-		GATHER_TRIANGLE_HI(m10, m11, m12, 5);
-		GATHER_TRIANGLE_HI(m20, m21, m22, 6);
-		GATHER_TRIANGLE_HI(m30, m31, m32, 7);
-		
-		SRAST_MM256_TRANSPOSE4_PS(m00, m10, m20, m30);
-		SRAST_MM256_TRANSPOSE4_PS(m01, m11, m21, m31);
-		SRAST_MM256_TRANSPOSE4_PS(m02, m12, m22, m32);
+	GATHER_TRIANGLE_LO(m00, m01, m02, 0);
+	GATHER_TRIANGLE_LO(m10, m11, m12, 1);
+	GATHER_TRIANGLE_LO(m20, m21, m22, 2);
+	GATHER_TRIANGLE_LO(m30, m31, m32, 3);
+	
+	GATHER_TRIANGLE_HI(m00, m01, m02, 4);
+	GATHER_TRIANGLE_HI(m10, m11, m12, 5);
+	GATHER_TRIANGLE_HI(m20, m21, m22, 6);
+	GATHER_TRIANGLE_HI(m30, m31, m32, 7);
+	
+	SRAST_MM256_TRANSPOSE4_PS(m00, m10, m20, m30);
+	SRAST_MM256_TRANSPOSE4_PS(m01, m11, m21, m31);
+	SRAST_MM256_TRANSPOSE4_PS(m02, m12, m22, m32);
 #else
-		GATHER_TRIANGLE(m00, m01, m02, 0);
-		GATHER_TRIANGLE(m10, m11, m12, 1);
-		GATHER_TRIANGLE(m20, m21, m22, 2);
-		GATHER_TRIANGLE(m30, m31, m32, 3);
-		
-		_MM_TRANSPOSE4_PS(m00, m10, m20, m30);
-		_MM_TRANSPOSE4_PS(m01, m11, m21, m31);
-		_MM_TRANSPOSE4_PS(m02, m12, m22, m32);
+	GATHER_TRIANGLE(m00, m01, m02, 0);
+	GATHER_TRIANGLE(m10, m11, m12, 1);
+	GATHER_TRIANGLE(m20, m21, m22, 2);
+	GATHER_TRIANGLE(m30, m31, m32, 3);
+	
+	_MM_TRANSPOSE4_PS(m00, m10, m20, m30);
+	_MM_TRANSPOSE4_PS(m01, m11, m21, m31);
+	_MM_TRANSPOSE4_PS(m02, m12, m22, m32);
 #endif
-		
-		simd_float3 v0(m00, m10, m30);
-		simd_float3 v1(m01, m11, m31);
-		simd_float3 v2(m02, m12, m32);
-		
-		simd_float z0(m20);
-		simd_float z1(m21);
-		simd_float z2(m22);
-
-		// View frustum cull.
-		if (mask(v0.z - abs(v0.x) | v0.z - abs(v0.y) | v0.z - abs(z0)) & laneMask) {
-			laneMask &= ~mask((v0.z - v0.x & v1.z - v1.x & v2.z - v2.x) |
-							  (v0.z + v0.x & v1.z + v1.x & v2.z + v2.x) |
-							  (v0.z - v0.y & v1.z - v1.y & v2.z - v2.y) |
-							  (v0.z + v0.y & v1.z + v1.y & v2.z + v2.y) |
-							  (v0.z - z0   & v1.z - z1   & v2.z - z2  ) |
-							  (v0.z + z0   & v1.z + z1   & v2.z + z2  ));
-		}
+	
+	simd_float3 v0(m00, m10, m30);
+	simd_float3 v1(m01, m11, m31);
+	simd_float3 v2(m02, m12, m32);
+	
+	simd_float z0(m20);
+	simd_float z1(m21);
+	simd_float z2(m22);
+
+	// View frustum cull.
+	if (mask(v0.z - abs(v0.x) | v0.z - abs(v0.y) | v0.z - abs(z0)) & laneMask) {
+		laneMask &= ~mask((v0.z - v0.x & v1.z - v1.x & v2.z - v2.x) |
+						  (v0.z + v0.x & v1.z + v1.x & v2.z + v2.x) |
+						  (v0.z - v0.y & v1.z - v1.y & v2.z - v2.y) |
+						  (v0.z + v0.y & v1.z + v1.y & v2.z + v2.y) |
+						  (v0.z - z0   & v1.z - z1   & v2.z - z2  ) |
+						  (v0.z + z0   & v1.z + z1   & v2.z + z2  ));
+	}
 
-		unsigned validFace = laneMask;
+	unsigned validFace = laneMask;
 
-		// Facing before snapping. Used for silhouette detection.
-		simd_float adj11 = v1.y*v2.z-v2.y*v1.z;
-		simd_float adj12 = v1.x*v2.z-v1.z*v2.x;
-		simd_float adj13 = v1.x*v2.y-v1.y*v2.x;
+	// Facing before snapping. Used for silhouette detection.
+	simd_float adj11 = v1.y*v2.z-v2.y*v1.z;
+	simd_float adj12 = v1.x*v2.z-v1.z*v2.x;
+	simd_float adj13 = v1.x*v2.y-v1.y*v2.x;
+	
+	unsigned backFacingBeforeSnap = mask(v0.x*adj11 - v0.y*adj12 + v0.z*adj13) & laneMask;
+	
+	if (laneMask) {
+		simd_float halfWidth = 0.5f*r.getRegionWidth();
+		simd_float halfHeight = 0.5f*r.getRegionHeight();
 		
-		unsigned backFacingBeforeSnap = mask(v0.x*adj11 - v0.y*adj12 + v0.z*adj13) & laneMask;
+		v0.x = v0.x * halfWidth;
+		v1.x = v1.x * halfWidth;
+		v2.x = v2.x * halfWidth;
 		
-		if (laneMask) {
-			simd_float halfWidth = 0.5f*r.getFrameBufferWidth();
-			simd_float halfHeight = 0.5f*r.getFrameBufferHeight();
-			
-			v0.x = v0.x * halfWidth;
-			v1.x = v1.x * halfWidth;
-			v2.x = v2.x * halfWidth;
-			
-			v0.y = v0.y * halfHeight;
-			v1.y = v1.y * halfHeight;
-			v2.y = v2.y * halfHeight;
-
-			/*
-			 Edges within the frustum are projected, possibly clipped and snapped, in order to guarantee watertight rendering.
-			 The _perfectly_ accurate range is p12+s4.
-			 
-			 The edge test is separated into per-pixel and per-sample computations.
-			 The required number of bits for each component is (for tile size = p3):
-			 
-			 PX: (p12+s4) * (p2) x2 = 19 bits
-			 SP: (p12+s4) * (s5) x2 = 22 bits
-			 EZ: (p12+s4) * (p2+s5) x2 = 24 bits
-			 LUT: SP+EZ
-			 
-			 Tile size p3 means p2 range since we offset from the middle.
-			 The sign bit is thus utilized, effectively giving us 25 bits of precision.
-			 
-			 The range in EZ comes from the fact that only locations within a tile need to be accurate.
-			 We accomplish this by storing 64-bit EZ and subtracting the tile center in high precision.
-			 
-			 Max res becomes 3584x3584 with a 128 pixel guardband.
-			*/
-
-			simd_float guardband = 1920.0f;
-			
-			simd_float gw0 = v0.z*guardband;
-			simd_float2 a0 = simd_float2(gw0, gw0) - v0.xy();
-			simd_float3 b0 = simd_float3(gw0, gw0, -1e-3f) + v0;
-			unsigned m0 = mask((a0.x | a0.y) | (b0.x | b0.y | b0.z)) & laneMask;
-			
-			simd_float gw1 = v1.z*guardband;
-			simd_float2 a1 = simd_float2(gw1, gw1) - v1.xy();
-			simd_float3 b1 = simd_float3(gw1, gw1, -1e-3f) + v1;
-			unsigned m1 = mask((a1.x | a1.y) | (b1.x | b1.y | b1.z)) & laneMask;
-			
-			simd_float gw2 = v2.z*guardband;
-			simd_float2 a2 = simd_float2(gw2, gw2) - v2.xy();
-			simd_float3 b2 = simd_float3(gw2, gw2, -1e-3f) + v2;
-			unsigned m2 = mask((a2.x | a2.y) | (b2.x | b2.y | b2.z)) & laneMask;
-			
-			simd_float4 edge0, edge1, edge2;
-			simd_double2 hpez0, hpez1, hpez2;
-			simd_float4 bb;
-
-			if ((m0 | m1 | m2) == 0) {
-				// Project and snap.
-				simd_float rz0 = simd_float(16.0f) / v0.z;
-				simd_float rz1 = simd_float(16.0f) / v1.z;
-				simd_float rz2 = simd_float(16.0f) / v2.z;
-				
-				simd_float2 p0, p1, p2;
-				
-				p0.x = round(v0.x*rz0) * (1.0f / 16.0f);
-				p0.y = round(v0.y*rz0) * (1.0f / 16.0f);
-				
-				p1.x = round(v1.x*rz1) * (1.0f / 16.0f);
-				p1.y = round(v1.y*rz1) * (1.0f / 16.0f);
-				
-				p2.x = round(v2.x*rz2) * (1.0f / 16.0f);
-				p2.y = round(v2.y*rz2) * (1.0f / 16.0f);
-				
-				// Compute bounding-box.
-				bb.x = min(p0.x, min(p1.x, p2.x));
-				bb.y = min(p0.y, min(p1.y, p2.y));
-				bb.z = max(p0.x, max(p1.x, p2.x));
-				bb.w = max(p0.y, max(p1.y, p2.y));
-				
-				// Compute edges.
-				edge0.x = p1.y - p2.y;
-				edge0.y = p2.x - p1.x;
-				edge0.z = p1.x*p2.y - p2.x*p1.y;
-				edge0.w = v1.z*v2.z;
-				
-				edge1.x = p2.y - p0.y;
-				edge1.y = p0.x - p2.x;
-				edge1.z = p2.x*p0.y - p0.x*p2.y;
-				edge1.w = v0.z*v2.z;
-				
-				edge2.x = p0.y - p1.y;
-				edge2.y = p1.x - p0.x;
-				edge2.z = p0.x*p1.y - p1.x*p0.y;
-				edge2.w = v0.z*v1.z;
-				
-				// Discard back-facing.
-				laneMask &= ~mask(p0.x*edge0.x + p0.y*edge0.y + edge0.z);
-				
-				// Top-left fill convention.
-				simd_float offset0 = blend(0.0f, -1.0f/(16.0f*32.0f), (edge0.x | ((edge0.x == simd_float::zero()) & edge0.y)));
-				simd_float offset1 = blend(0.0f, -1.0f/(16.0f*32.0f), (edge1.x | ((edge1.x == simd_float::zero()) & edge1.y)));
-				simd_float offset2 = blend(0.0f, -1.0f/(16.0f*32.0f), (edge2.x | ((edge2.x == simd_float::zero()) & edge2.y)));
-				
-				// High-precision edge z.
-				hpez0.x = float2double_lo(p1.x)*float2double_lo(p2.y) - float2double_lo(p2.x)*float2double_lo(p1.y) + float2double_lo(offset0);
-				hpez0.y = float2double_hi(p1.x)*float2double_hi(p2.y) - float2double_hi(p2.x)*float2double_hi(p1.y) + float2double_hi(offset0);
-				
-				hpez1.x = float2double_lo(p2.x)*float2double_lo(p0.y) - float2double_lo(p0.x)*float2double_lo(p2.y) + float2double_lo(offset1);
-				hpez1.y = float2double_hi(p2.x)*float2double_hi(p0.y) - float2double_hi(p0.x)*float2double_hi(p2.y) + float2double_hi(offset1);
-				
-				hpez2.x = float2double_lo(p0.x)*float2double_lo(p1.y) - float2double_lo(p1.x)*float2double_lo(p0.y) + float2double_lo(offset2);
-				hpez2.y = float2double_hi(p0.x)*float2double_hi(p1.y) - float2double_hi(p1.x)*float2double_hi(p0.y) + float2double_hi(offset2);
-			}
-			else {
-				simd_float3 ev0, ev1, ev2;
-				edge0 = computeClippedEdge<true>(v1, a1, b1, v2, a2, b2, hpez0, bb, halfWidth, halfHeight, ev1);
-				edge1 = computeClippedEdge<false>(v2, a2, b2, v0, a0, b0, hpez1, bb, halfWidth, halfHeight, ev2);
-				edge2 = computeClippedEdge<false>(v0, a0, b0, v1, a1, b1, hpez2, bb, halfWidth, halfHeight, ev0);
-
-				// Discard back-facing.
-				laneMask &= ~mask((ev1.x*edge1.x + ev1.y*edge1.y + ev1.z*edge1.z) &
-								  (ev2.x*edge2.x + ev2.y*edge2.y + ev2.z*edge2.z) &
-								  (ev0.x*edge0.x + ev0.y*edge0.y + ev0.z*edge0.z));
-			}
-
-			// Discard degenerates.
-			laneMask &= ~mask(((edge0.x == simd_float::zero()) & (edge0.y == simd_float::zero())) |
-							  ((edge1.x == simd_float::zero()) & (edge1.y == simd_float::zero())) |
-							  ((edge2.x == simd_float::zero()) & (edge2.y == simd_float::zero())));
+		v0.y = v0.y * halfHeight;
+		v1.y = v1.y * halfHeight;
+		v2.y = v2.y * halfHeight;
+
+		/*
+		 Edges within the frustum are projected, possibly clipped and snapped, in order to guarantee watertight rendering.
+		 Snapped coordinates are 28.4 integers and the edge constants are exact 64-bit integers.
+		 
+		 Resolve evaluates the edges in float, relative to the tile center. The constant is rebased
+		 exactly in integer and clamped to 2^23 (1/512 pixels), which keeps every sample test exact
+		 as long as the per-tile range of the edge fits in 24 bits. Edges longer than 2048 pixels are
+		 rebased per pixel instead, which extends the exact range to 16384 pixels.
+		 
+		 The guardband bounds edges to 2*4096 pixels in each direction.
+		 Max res becomes 8192x8192. Larger frame buffers are split into regions by the renderer.
+		*/
+
+		simd_float gw0 = v0.z*simd_float(guardband);
+		simd_float2 a0 = simd_float2(gw0, gw0) - v0.xy();
+		simd_float3 b0 = simd_float3(gw0, gw0, -1e-3f) + v0;
+		unsigned m0 = mask((a0.x | a0.y) | (b0.x | b0.y | b0.z)) & laneMask;
+		
+		simd_float gw1 = v1.z*simd_float(guardband);
+		simd_float2 a1 = simd_float2(gw1, gw1) - v1.xy();
+		simd_float3 b1 = simd_float3(gw1, gw1, -1e-3f) + v1;
+		unsigned m1 = mask((a1.x | a1.y) | (b1.x | b1.y | b1.z)) & laneMask;
+		
+		simd_float gw2 = v2.z*simd_float(guardband);
+		simd_float2 a2 = simd_float2(gw2, gw2) - v2.xy();
+		simd_float3 b2 = simd_float3(gw2, gw2, -1e-3f) + v2;
+		unsigned m2 = mask((a2.x | a2.y) | (b2.x | b2.y | b2.z)) & laneMask;
+		
+		simd_float4 edge0, edge1, edge2;
+		simd_float ea0, ea1, ea2;
+		simd_float eb0, eb1, eb2;
+		SRAST_SIMD_ALIGNED long long ec0[simd_float::width];
+		SRAST_SIMD_ALIGNED long long ec1[simd_float::width];
+		SRAST_SIMD_ALIGNED long long ec2[simd_float::width];
+		simd_float4 bb;
+
+		if (!Clipped) {
+			deferred = m0 | m1 | m2;
+			laneMask &= ~deferred;
+			
+			// Project and snap.
+			simd_float rz0 = simd_float(16.0f) / v0.z;
+			simd_float rz1 = simd_float(16.0f) / v1.z;
+			simd_float rz2 = simd_float(16.0f) / v2.z;
+			
+			simd_float2 i0, i1, i2;
+			
+			i0.x = round(v0.x*rz0);
+			i0.y = round(v0.y*rz0);
+			
+			i1.x = round(v1.x*rz1);
+			i1.y = round(v1.y*rz1);
+			
+			i2.x = round(v2.x*rz2);
+			i2.y = round(v2.y*rz2);
+			
+			simd_float2 p0 = i0 * (1.0f / 16.0f);
+			simd_float2 p1 = i1 * (1.0f / 16.0f);
+			simd_float2 p2 = i2 * (1.0f / 16.0f);
+			
+			// Compute bounding-box.
+			bb.x = min(p0.x, min(p1.x, p2.x));
+			bb.y = min(p0.y, min(p1.y, p2.y));
+			bb.z = max(p0.x, max(p1.x, p2.x));
+			bb.w = max(p0.y, max(p1.y, p2.y));
+			
+			// Compute edges.
+			edge0.x = p1.y - p2.y;
+			edge0.y = p2.x - p1.x;
+			edge0.z = p1.x*p2.y - p2.x*p1.y;
+			edge0.w = v1.z*v2.z;
 			
-			bb.x += halfWidth;
-			bb.z += halfWidth;
-			bb.y += halfHeight;
-			bb.w += halfHeight;
+			edge1.x = p2.y - p0.y;
+			edge1.y = p0.x - p2.x;
+			edge1.z = p2.x*p0.y - p0.x*p2.y;
+			edge1.w = v0.z*v2.z;
 			
-			bb.x = max(bb.x, simd_float::zero());
-			bb.y = max(bb.y, simd_float::zero());
-			bb.z = min(bb.z, (float)(int)r.getFrameBufferWidth());
-			bb.w = min(bb.w, (float)(int)r.getFrameBufferHeight());
+			edge2.x = p0.y - p1.y;
+			edge2.y = p1.x - p0.x;
+			edge2.z = p0.x*p1.y - p1.x*p0.y;
+			edge2.w = v0.z*v1.z;
 			
-			laneMask &= mask((bb.x < bb.z) & (bb.y < bb.w));
+			// Discard back-facing.
+			laneMask &= ~mask(p0.x*edge0.x + p0.y*edge0.y + edge0.z);
 			
-			// Encode each bounding-box as one double.
+			// Fixed-point edges.
+			ea0 = float_to_int32(i1.y - i2.y);
+			eb0 = float_to_int32(i2.x - i1.x);
+			ea1 = float_to_int32(i2.y - i0.y);
+			eb1 = float_to_int32(i0.x - i2.x);
+			ea2 = float_to_int32(i0.y - i1.y);
+			eb2 = float_to_int32(i1.x - i0.x);
+			
+			i0 = simd_float2(float_to_int32(i0.x), float_to_int32(i0.y));
+			i1 = simd_float2(float_to_int32(i1.x), float_to_int32(i1.y));
+			i2 = simd_float2(float_to_int32(i2.x), float_to_int32(i2.y));
+			
+			// Top-left fill convention.
+			computeEdgeConstant(ec0, i1.x, i1.y, i2.x, i2.y, edge0.x | ((edge0.x == simd_float::zero()) & edge0.y));
+			computeEdgeConstant(ec1, i2.x, i2.y, i0.x, i0.y, edge1.x | ((edge1.x == simd_float::zero()) & edge1.y));
+			computeEdgeConstant(ec2, i0.x, i0.y, i1.x, i1.y, edge2.x | ((edge2.x == simd_float::zero()) & edge2.y));
+
+			if (r.hasConservativeCoverage()) {
+				expandEdgeConstant(ec0, ea0, eb0);
+				expandEdgeConstant(ec1, ea1, eb1);
+				expandEdgeConstant(ec2, ea2, eb2);
+			}
+		}
+		else {
+			simd_float3 ev0, ev1, ev2;
+			edge0 = computeClippedEdge<true>(v1, a1, b1, v2, a2, b2, ea0, eb0, ec0, bb, halfWidth, halfHeight, ev1, r.hasConservativeCoverage());
+			edge1 = computeClippedEdge<false>(v2, a2, b2, v0, a0, b0, ea1, eb1, ec1, bb, halfWidth, halfHeight, ev2, r.hasConservativeCoverage());
+			edge2 = computeClippedEdge<false>(v0, a0, b0, v1, a1, b1, ea2, eb2, ec2, bb, halfWidth, halfHeight, ev0, r.hasConservativeCoverage());
+
+			// Discard back-facing.
+			laneMask &= ~mask((ev1.x*edge1.x + ev1.y*edge1.y + ev1.z*edge1.z) &
+							  (ev2.x*edge2.x + ev2.y*edge2.y + ev2.z*edge2.z) &
+							  (ev0.x*edge0.x + ev0.y*edge0.y + ev0.z*edge0.z));
+		}
+		
+		// Discard degenerates.
+		laneMask &= ~mask(((edge0.x == simd_float::zero()) & (edge0.y == simd_float::zero())) |
+						  ((edge1.x == simd_float::zero()) & (edge1.y == simd_float::zero())) |
+						  ((edge2.x == simd_float::zero()) & (edge2.y == simd_float::zero())));
+		
+		bb.x += halfWidth;
+		bb.z += halfWidth;
+		bb.y += halfHeight;
+		bb.w += halfHeight;
+		
+		bb.x = max(bb.x, simd_float::zero());
+		bb.y = max(bb.y, simd_float::zero());
+		bb.z = min(bb.z, (float)(int)r.getRegionWidth());
+		bb.w = min(bb.w, (float)(int)r.getRegionHeight());
+		
+		laneMask &= mask((bb.x < bb.z) & (bb.y < bb.w));
+		
+		// Encode each bounding-box as one double.
 #ifdef SRAST_AVX
-			vec2<simd4_float> bbfl = encodeBoundingBox(vec4<simd4_float>(bb.x.low(), bb.y.low(), bb.z.low(), bb.w.low()));
-			vec2<simd4_float> bbfh = encodeBoundingBox(vec4<simd4_float>(bb.x.high(), bb.y.high(), bb.z.high(), bb.w.high()));
+		vec2<simd4_float> bbfl = encodeBoundingBox(vec4<simd4_float>(bb.x.low(), bb.y.low(), bb.z.low(), bb.w.low()));
+		vec2<simd4_float> bbfh = encodeBoundingBox(vec4<simd4_float>(bb.x.high(), bb.y.high(), bb.z.high(), bb.w.high()));
 
-			simd_float2 bbf(simd_float_combine(bbfl.x.mm, bbfh.x.mm), simd_float_combine(bbfl.y.mm, bbfh.y.mm));
+		simd_float2 bbf(simd_float_combine(bbfl.x.mm, bbfh.x.mm), simd_float_combine(bbfl.y.mm, bbfh.y.mm));
 #else
-			simd_float2 bbf = encodeBoundingBox(bb);
+		simd_float2 bbf = encodeBoundingBox(bb);
 #endif
 
-			if (laneMask) {
-				unsigned idx = ((unsigned)i)/3;
-				
-				double* __restrict highpEdgeZ0 = drawCall.highpEdgeZ0 + idx;
-				double* __restrict highpEdgeZ1 = drawCall.highpEdgeZ1 + idx;
-				double* __restrict highpEdgeZ2 = drawCall.highpEdgeZ2 + idx;
-
-				hpez0.x.stream_store(highpEdgeZ0);
-				hpez0.y.stream_store(highpEdgeZ0 + simd_double::width);
-				hpez1.x.stream_store(highpEdgeZ1);
-				hpez1.y.stream_store(highpEdgeZ1 + simd_double::width);
-				hpez2.x.stream_store(highpEdgeZ2);
-				hpez2.y.stream_store(highpEdgeZ2 + simd_double::width);
-
-				// Map z from [-1 1] to [1 0]. Note the reversed range for improved precision at the far plane.
-				z0 = (v0.z-z0)*0.5f;
-				z1 = (v1.z-z1)*0.5f;
-				z2 = (v2.z-z2)*0.5f;
-				
-				simd_float zw0 = z0 * edge0.w;
-				simd_float zw1 = z1 * edge1.w;
-				simd_float zw2 = z2 * edge2.w;
-				
-				simd_float ez0 = (edge0.x*zw0 + edge1.x*zw1 + edge2.x*zw2);
-				simd_float ez1 = (edge0.y*zw0 + edge1.y*zw1 + edge2.y*zw2);
-				simd_float ez2 = (edge0.z*zw0 + edge1.z*zw1 + edge2.z*zw2);
-				
-				simd_float invDet = (z0 + z1 + z2) / (ez0*v0.x + ez1*v0.y + ez2*v0.z +
-													  ez0*v1.x + ez1*v1.y + ez2*v1.z +
-													  ez0*v2.x + ez1*v2.y + ez2*v2.z);
-				ez0 = ez0 * invDet;
-				ez1 = ez1 * invDet;
-				ez2 = ez2 * invDet;
+		if (laneMask) {
+			// Map z from [-1 1] to [1 0]. Note the reversed range for improved precision at the far plane.
+			z0 = (v0.z-z0)*0.5f;
+			z1 = (v1.z-z1)*0.5f;
+			z2 = (v2.z-z2)*0.5f;
+			
+			simd_float zw0 = z0 * edge0.w;
+			simd_float zw1 = z1 * edge1.w;
+			simd_float zw2 = z2 * edge2.w;
+			
+			simd_float ez0 = (edge0.x*zw0 + edge1.x*zw1 + edge2.x*zw2);
+			simd_float ez1 = (edge0.y*zw0 + edge1.y*zw1 + edge2.y*zw2);
+			simd_float ez2 = (edge0.z*zw0 + edge1.z*zw1 + edge2.z*zw2);
+			
+			simd_float invDet = (z0 + z1 + z2) / (ez0*v0.x + ez1*v0.y + ez2*v0.z +
+												  ez0*v1.x + ez1*v1.y + ez2*v1.z +
+												  ez0*v2.x + ez1*v2.y + ez2*v2.z);
+			ez0 = ez0 * invDet;
+			ez1 = ez1 * invDet;
+			ez2 = ez2 * invDet;
+
+			// Z-min/max vertex.
+			simd_float pz0 = ZMode::nearClip(z0/v0.z, v0.z > 0.0f);
+			simd_float pz1 = ZMode::nearClip(z1/v1.z, v1.z > 0.0f);
+			simd_float pz2 = ZMode::nearClip(z2/v2.z, v2.z > 0.0f);
 
-				// Z-min/max vertex.
-				simd_float pz0 = ZMode::nearClip(z0/v0.z, v0.z > 0.0f);
-				simd_float pz1 = ZMode::nearClip(z1/v1.z, v1.z > 0.0f);
-				simd_float pz2 = ZMode::nearClip(z2/v2.z, v2.z > 0.0f);
+			simd_float zminVertex =  ZMode::min(pz0, ZMode::min(pz1, pz2));
+			simd_float zmaxVertex = ZMode::min(ZMode::max(pz0, ZMode::max(pz1, pz2)), SRAST_FAR_Z);
 
-				simd_float zminVertex =  ZMode::min(pz0, ZMode::min(pz1, pz2));
-				simd_float zmaxVertex = ZMode::min(ZMode::max(pz0, ZMode::max(pz1, pz2)), SRAST_FAR_Z);
+			m00 = ea0.mm; m10 = ea1.mm; m20 = ea2.mm; m30 = ez0.mm;
+			m01 = eb0.mm; m11 = eb1.mm; m21 = eb2.mm; m31 = ez1.mm;
+			m02 = bbf.x.mm; m12 = bbf.y.mm; m22 = zminVertex.mm; m32 = zmaxVertex.mm;
+
+			TriangleEdges* __restrict edges = drawCall.edges;
 
 #ifdef SRAST_AVX
-				__m256 m03, m13, m23, m33;
+			SRAST_MM256_TRANSPOSE4_PS(m00, m10, m20, m30);
+			SRAST_MM256_TRANSPOSE4_PS(m01, m11, m21, m31);
+			SRAST_MM256_TRANSPOSE4_PS(m02, m12, m22, m32);
+			
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[0]) + 0, _mm256_castps256_ps128(m00));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[0]) + 4, _mm256_castps256_ps128(m01));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[0]) + 8, _mm256_castps256_ps128(m02));
+			
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[1]) + 0, _mm256_castps256_ps128(m10));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[1]) + 4, _mm256_castps256_ps128(m11));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[1]) + 8, _mm256_castps256_ps128(m12));
+			
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[2]) + 0, _mm256_castps256_ps128(m20));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[2]) + 4, _mm256_castps256_ps128(m21));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[2]) + 8, _mm256_castps256_ps128(m22));
+			
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[3]) + 0, _mm256_castps256_ps128(m30));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[3]) + 4, _mm256_castps256_ps128(m31));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[3]) + 8, _mm256_castps256_ps128(m32));
+			
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[4]) + 0, _mm256_extractf128_ps(m00, 1));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[4]) + 4, _mm256_extractf128_ps(m01, 1));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[4]) + 8, _mm256_extractf128_ps(m02, 1));
+			
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[5]) + 0, _mm256_extractf128_ps(m10, 1));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[5]) + 4, _mm256_extractf128_ps(m11, 1));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[5]) + 8, _mm256_extractf128_ps(m12, 1));
+			
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[6]) + 0, _mm256_extractf128_ps(m20, 1));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[6]) + 4, _mm256_extractf128_ps(m21, 1));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[6]) + 8, _mm256_extractf128_ps(m22, 1));
+			
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[7]) + 0, _mm256_extractf128_ps(m30, 1));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[7]) + 4, _mm256_extractf128_ps(m31, 1));
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[7]) + 8, _mm256_extractf128_ps(m32, 1));
 #else
-				__m128 m03, m13, m23, m33;
+			_MM_TRANSPOSE4_PS(m00, m10, m20, m30);
+			_MM_TRANSPOSE4_PS(m01, m11, m21, m31);
+			_MM_TRANSPOSE4_PS(m02, m12, m22, m32);
+			
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[0]) + 0, m00);
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[0]) + 4, m01);
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[0]) + 8, m02);
+			
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[1]) + 0, m10);
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[1]) + 4, m11);
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[1]) + 8, m12);
+			
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[2]) + 0, m20);
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[2]) + 4, m21);
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[2]) + 8, m22);
+			
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[3]) + 0, m30);
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[3]) + 4, m31);
+			_mm_stream_ps(reinterpret_cast<float*>(edges + triangles[3]) + 8, m32);
 #endif
-				
-				m00 = edge0.x.mm; m10 = edge0.y.mm; m20 = edge0.z.mm; m30 = ez0.mm;
-				m01 = edge1.x.mm; m11 = edge1.y.mm; m21 = edge1.z.mm; m31 = ez1.mm;
-				m02 = edge2.x.mm; m12 = edge2.y.mm; m22 = edge2.z.mm; m32 = ez2.mm;
-				m03 = bbf.x.mm; m13 = bbf.y.mm; m23 = zminVertex.mm; m33 = zmaxVertex.mm;
 
-#ifdef SRAST_AVX
-				SRAST_MM256_TRANSPOSE4_PS(m00, m10, m20, m30);
-				SRAST_MM256_TRANSPOSE4_PS(m01, m11, m21, m31);
-				SRAST_MM256_TRANSPOSE4_PS(m02, m12, m22, m32);
-				SRAST_MM256_TRANSPOSE4_PS(m03, m13, m23, m33);
-				
-				_mm_stream_ps(&drawCall.edges[idx*4+0+0].x, _mm256_castps256_ps128(m00));
-				_mm_stream_ps(&drawCall.edges[idx*4+0+1].x, _mm256_castps256_ps128(m01));
-				_mm_stream_ps(&drawCall.edges[idx*4+0+2].x, _mm256_castps256_ps128(m02));
-				_mm_stream_ps(&drawCall.edges[idx*4+0+3].x, _mm256_castps256_ps128(m03));
-				
-				_mm_stream_ps(&drawCall.edges[idx*4+4+0].x, _mm256_castps256_ps128(m10));
-				_mm_stream_ps(&drawCall.edges[idx*4+4+1].x, _mm256_castps256_ps128(m11));
-				_mm_stream_ps(&drawCall.edges[idx*4+4+2].x, _mm256_castps256_ps128(m12));
-				_mm_stream_ps(&drawCall.edges[idx*4+4+3].x, _mm256_castps256_ps128(m13));
-				
-				_mm_stream_ps(&drawCall.edges[idx*4+8+0].x, _mm256_castps256_ps128(m20));
-				_mm_stream_ps(&drawCall.edges[idx*4+8+1].x, _mm256_castps256_ps128(m21));
-				_mm_stream_ps(&drawCall.edges[idx*4+8+2].x, _mm256_castps256_ps128(m22));
-				_mm_stream_ps(&drawCall.edges[idx*4+8+3].x, _mm256_castps256_ps128(m23));
-				
-				_mm_stream_ps(&drawCall.edges[idx*4+12+0].x, _mm256_castps256_ps128(m30));
-				_mm_stream_ps(&drawCall.edges[idx*4+12+1].x, _mm256_castps256_ps128(m31));
-				_mm_stream_ps(&drawCall.edges[idx*4+12+2].x, _mm256_castps256_ps128(m32));
-				_mm_stream_ps(&drawCall.edges[idx*4+12+3].x, _mm256_castps256_ps128(m33));
-				
-				_mm_stream_ps(&drawCall.edges[idx*4+16+0].x, _mm256_extractf128_ps(m00, 1));
-				_mm_stream_ps(&drawCall.edges[idx*4+16+1].x, _mm256_extractf128_ps(m01, 1));
-				_mm_stream_ps(&drawCall.edges[idx*4+16+2].x, _mm256_extractf128_ps(m02, 1));
-				_mm_stream_ps(&drawCall.edges[idx*4+16+3].x, _mm256_extractf128_ps(m03, 1));
-				
-				_mm_stream_ps(&drawCall.edges[idx*4+20+0].x, _mm256_extractf128_ps(m10, 1));
-				_mm_stream_ps(&drawCall.edges[idx*4+20+1].x, _mm256_extractf128_ps(m11, 1));
-				_mm_stream_ps(&drawCall.edges[idx*4+20+2].x, _mm256_extractf128_ps(m12, 1));
-				_mm_stream_ps(&drawCall.edges[idx*4+20+3].x, _mm256_extractf128_ps(m13, 1));
-				
-				_mm_stream_ps(&drawCall.edges[idx*4+24+0].x, _mm256_extractf128_ps(m20, 1));
-				_mm_stream_ps(&drawCall.edges[idx*4+24+1].x, _mm256_extractf128_ps(m21, 1));
-				_mm_stream_ps(&drawCall.edges[idx*4+24+2].x, _mm256_extractf128_ps(m22, 1));
-				_mm_stream_ps(&drawCall.edges[idx*4+24+3].x, _mm256_extractf128_ps(m23, 1));
-				
-				_mm_stream_ps(&drawCall.edges[idx*4+28+0].x, _mm256_extractf128_ps(m30, 1));
-				_mm_stream_ps(&drawCall.edges[idx*4+28+1].x, _mm256_extractf128_ps(m31, 1));
-				_mm_stream_ps(&drawCall.edges[idx*4+28+2].x, _mm256_extractf128_ps(m32, 1));
-				_mm_stream_ps(&drawCall.edges[idx*4+28+3].x, _mm256_extractf128_ps(m33, 1));
-#else
-				_MM_TRANSPOSE4_PS(m00, m10, m20, m30);
-				_MM_TRANSPOSE4_PS(m01, m11, m21, m31);
-				_MM_TRANSPOSE4_PS(m02, m12, m22, m32);
-				_MM_TRANSPOSE4_PS(m03, m13, m23, m33);
-				
-				_mm_stream_ps(&drawCall.edges[idx*4+0+0].x, m00);
-				_mm_stream_ps(&drawCall.edges[idx*4+0+1].x, m01);
-				_mm_stream_ps(&drawCall.edges[idx*4+0+2].x, m02);
-				_mm_stream_ps(&drawCall.edges[idx*4+0+3].x, m03);
+			// Edge constants and z.
+			SRAST_SIMD_ALIGNED float eza[simd_float::width];
+			ez2.store(eza);
+
+			for (unsigned j = 0; j < simd_float::width; ++j) {
+				__m128i c01 = _mm_set_epi64x(ec1[j], ec0[j]);
+				__m128i c2z = _mm_set_epi64x((long long)float_as_uint32(eza[j]), ec2[j]);
+				_mm_stream_si128(reinterpret_cast<__m128i*>(edges[triangles[j]].c) + 0, c01);
+				_mm_stream_si128(reinterpret_cast<__m128i*>(edges[triangles[j]].c) + 1, c2z);
+			}
+		}
+	}
+	
+	for (unsigned j = 0; j < simd_float::width; ++j) {
+		flags[triangles[j]] = (unsigned char)((1 - ((laneMask >> j) & 1)) | (((validFace >> j) & 1) << 1) | (((backFacingBeforeSnap >> j) & 1) << 2));
+	}
+
+	return deferred;
+}
+
+/*
+ Post-transform cache for fused vertex shading. Each thread keeps its cache across work items until it
+ moves to another draw call, and setup reads the positions of a batch from it. Vertices that collide
+ with another vertex of the same batch are stored past the tagged entries. The first thread to shade
+ a vertex in the frame claims it and writes its position to shadedPositions, which HiM rasterization
+ and resolve read.
+*/
+static const unsigned vertexCacheSizeLog2 = 9;
+
+struct SRAST_ALIGNED(16) VertexCache {
+	unsigned tags[1 << vertexCacheSizeLog2];
+	float4 positions[(1 << vertexCacheSizeLog2) + 3*simd_float::width];
+	float4 output[4*simd_float::width];
+	const DrawCall* drawCall;
+	unsigned stamp;
+	
+	static unsigned size(unsigned vertexStride) {
+		return sizeof(VertexCache) + 4*simd_float::width*vertexStride;
+	}
+	
+	char* input() {
+		return reinterpret_cast<char*>(this + 1);
+	}
+	
+	void clear() {
+		std::memset(tags, 0xff, sizeof(tags));
+	}
+};
+
+// Shades the vertices of a batch that are not in the cache, and finds the cache entry of each triangle corner.
+template<class T>
+static void shadeTriangleVertices(DrawCall& drawCall, T indices, const unsigned* __restrict triangles, unsigned laneMask, VertexCache& cache, unsigned* __restrict slots) {
+	const float* vertices = static_cast<const float*>(drawCall.vertexBuffer.data);
+	unsigned vertexSizeInSSE = drawCall.vertexBuffer.stride / 16;
+	
+	float* __restrict input = reinterpret_cast<float*>(cache.input());
+	unsigned missing[3*simd_float::width];
+	unsigned missingSlots[3*simd_float::width];
+	unsigned missCount = 0;
+	unsigned collisions = 0;
+	
+	unsigned long long usedSlots[(1 << vertexCacheSizeLog2) / 64] = {};
+	
+	for (unsigned j = 0; j < simd_float::width && (laneMask >> j & 1); ++j) {
+		int3 ind = indices(3*triangles[j]);
+		
+		for (unsigned k = 0; k < 3; ++k) {
+			unsigned v = ind[k];
+			unsigned slot = v & ((1 << vertexCacheSizeLog2)-1);
+			unsigned long long& used = usedSlots[slot >> 6];
+			unsigned long long slotBit = 1ull << (slot & 63);
+			
+			if (cache.tags[slot] != v) {
+				if (used & slotBit)
+					slot = (1 << vertexCacheSizeLog2) + collisions++;
+				else
+					cache.tags[slot] = v;
 				
-				_mm_stream_ps(&drawCall.edges[idx*4+4+0].x, m10);
-				_mm_stream_ps(&drawCall.edges[idx*4+4+1].x, m11);
-				_mm_stream_ps(&drawCall.edges[idx*4+4+2].x, m12);
-				_mm_stream_ps(&drawCall.edges[idx*4+4+3].x, m13);
+				const float* src = vertices + v*vertexSizeInSSE*4;
+				float* dst = input + missCount*vertexSizeInSSE*4;
 				
-				_mm_stream_ps(&drawCall.edges[idx*4+8+0].x, m20);
-				_mm_stream_ps(&drawCall.edges[idx*4+8+1].x, m21);
-				_mm_stream_ps(&drawCall.edges[idx*4+8+2].x, m22);
-				_mm_stream_ps(&drawCall.edges[idx*4+8+3].x, m23);
+				for (unsigned i = 0; i < vertexSizeInSSE; ++i)
+					_mm_store_ps(dst + i*4, _mm_load_ps(src + i*4));
 				
-				_mm_stream_ps(&drawCall.edges[idx*4+12+0].x, m30);
-				_mm_stream_ps(&drawCall.edges[idx*4+12+1].x, m31);
-				_mm_stream_ps(&drawCall.edges[idx*4+12+2].x, m32);
-				_mm_stream_ps(&drawCall.edges[idx*4+12+3].x, m33);
-#endif
+				missing[missCount] = v;
+				missingSlots[missCount++] = slot;
 			}
+			
+			used |= slotBit;
+			slots[3*j + k] = slot;
 		}
+	}
+	
+	if (missCount == 0)
+		return;
+	
+	drawCall.vertexRenderState.executeShader(input, cache.output, missCount);
+	
+	for (unsigned i = 0; i < missCount; ++i) {
+		__m128 position = _mm_load_ps(&cache.output[i].x);
+		_mm_store_ps(&cache.positions[missingSlots[i]].x, position);
+		
+		int* state = reinterpret_cast<int*>(drawCall.shadedPositionStates + missing[i]);
+		int s = Atomics::loadAcquire(state);
+		
+		if (s != (int)cache.stamp && Atomics::compareAndSwap(state, cache.stamp, s) == s)
+			_mm_store_ps(&drawCall.shadedPositions[missing[i]].x, position);
+	}
+}
+
+// Sets up one batch of triangles, shading their vertices first with fused vertex shading.
+template<class ZMode, bool Clipped, class T>
+static unsigned setupTriangleBatch(Renderer& r, DrawCall& drawCall, T indices, const unsigned* __restrict triangles, unsigned laneMask, VertexCache* vertexCache) {
+	if (!vertexCache)
+		return setupTriangleBatch<ZMode, Clipped>(r, drawCall, indices, ShadedPositions(drawCall.shadedPositions), triangles, laneMask);
+	
+	unsigned slots[3*simd_float::width];
+	shadeTriangleVertices(drawCall, indices, triangles, laneMask, *vertexCache, slots);
+	return setupTriangleBatch<ZMode, Clipped>(r, drawCall, indices, CachedPositions(vertexCache->positions, slots), triangles, laneMask);
+}
+
+template<class ZMode, class T>
+static void setupDrawCallTriangles(Renderer& r, DrawCall& drawCall, T indices, unsigned start, unsigned end, VertexCache* vertexCache) {
+	// Triangles that cross the guardband are queued and clipped in full batches, keeping the common path free of them.
+	unsigned clipQueue[2*simd_float::width];
+	unsigned clipQueueSize = 0;
+	
+	unsigned triangleStart = start/3;
+	unsigned triangleEnd = end/3;
+	
+	// Unused lanes write to the padding after the last triangle, as the range may end where another work item starts.
+	unsigned padding = drawCall.triangleCount();
+	
+	for (unsigned i = triangleStart; i < triangleEnd; i += simd_float::width) {
+		unsigned triangles[simd_float::width];
+		unsigned laneMask = 0;
 		
 		for (unsigned j = 0; j < simd_float::width; ++j) {
-			*(flags++) = (unsigned char)((1 - ((laneMask >> j) & 1)) | (((validFace >> j) & 1) << 1) | (((backFacingBeforeSnap >> j) & 1) << 2));
+			triangles[j] = padding;
+			
+			if (i + j < triangleEnd) {
+				triangles[j] = i + j;
+				laneMask |= 1 << j;
+			}
 		}
+		
+		unsigned deferred = setupTriangleBatch<ZMode, false>(r, drawCall, indices, triangles, laneMask, vertexCache);
+		
+		while (deferred) {
+			clipQueue[clipQueueSize++] = i + __builtin_ctz(deferred);
+			deferred &= deferred-1;
+		}
+		
+		if (clipQueueSize >= simd_float::width) {
+			setupTriangleBatch<ZMode, true>(r, drawCall, indices, clipQueue, (1 << simd_float::width)-1, vertexCache);
+			clipQueueSize -= simd_float::width;
+			
+			for (unsigned j = 0; j < clipQueueSize; ++j)
+				clipQueue[j] = clipQueue[j + simd_float::width];
+		}
+	}
+	
+	if (clipQueueSize) {
+		for (unsigned j = clipQueueSize; j < simd_float::width; ++j)
+			clipQueue[j] = padding;
+		
+		setupTriangleBatch<ZMode, true>(r, drawCall, indices, clipQueue, (1 << clipQueueSize)-1, vertexCache);
+	}
+}
+
+template<class ZMode, class T>
+static void setupTriangleRange(Renderer& r, DrawCall& drawCall, T indices, unsigned start, unsigned end, VertexCache* vertexCache) {
+	setupDrawCallTriangles<ZMode>(r, drawCall, indices, start, end, vertexCache);
+}
+
+// Instanced draw calls are set up one instance at a time with the offsets of the instance in the indices.
+template<class ZMode, class T>
+static void setupTriangleRange(Renderer& r, DrawCall& drawCall, InstanceIndexProvider<T> indices, unsigned start, unsigned end, VertexCache* vertexCache) {
+	while (start < end) {
+		unsigned instance = start / indices.indexCount;
+		unsigned last = std::min(end, (instance+1)*indices.indexCount);
+		
+		indices.indexBase = instance*indices.indexCount;
+		indices.vertexBase = instance*drawCall.vertexBuffer.count;
+		
+		setupDrawCallTriangles<ZMode>(r, drawCall, indices, start, last, vertexCache);
+		start = last;
 	}
 }
 
 template<class T>
+static void setupTriangles(Renderer& r, DrawCall& drawCall, T indices, unsigned start, unsigned end, VertexCache* vertexCache) {
+	if (drawCall.instanceBuffer.data)
+		setupTriangleRange<ZLessMode>(r, drawCall, InstanceIndexProvider<T>(indices, 3*drawCall.instanceTriangleCount()), 3*start, 3*end, vertexCache);
+	else
+		setupTriangleRange<ZLessMode>(r, drawCall, indices, 3*start, 3*end, vertexCache);
+}
+
+static void setupTriangles(Renderer& r, DrawCall& drawCall, unsigned start, unsigned end, VertexCache* vertexCache) {
+	if (drawCall.indexBuffer.stride == 1)
+		setupTriangles(r, drawCall, IndexProvider<unsigned char>(drawCall.indexBuffer.data), start, end, vertexCache);
+	else if (drawCall.indexBuffer.stride == 2)
+		setupTriangles(r, drawCall, IndexProvider<unsigned short>(drawCall.indexBuffer.data), start, end, vertexCache);
+	else if (drawCall.indexBuffer.stride == 4)
+		setupTriangles(r, drawCall, IndexProvider<unsigned int>(drawCall.indexBuffer.data), start, end, vertexCache);
+	else
+		setupTriangles(r, drawCall, IndexProvider<>(), start, end, vertexCache);
+}
+
 class TriangleSetupTask : public ThreadPoolTask {
 private:
 	Renderer& r;
-	DrawCall& drawCall;
-	T indices;
+	DrawCallBatch& batch;
 	
 public:
-	TriangleSetupTask(Renderer& r, DrawCall& drawCall, T indices) : r(r), drawCall(drawCall), indices(indices) {
+	TriangleSetupTask(Renderer& r, DrawCallBatch& batch) : r(r), batch(batch) {
 	}
 	
 	virtual void run(unsigned start, unsigned end, unsigned thread) {
-		setupDrawCallTriangles<ZLessMode>(r, drawCall, indices, start, end, thread);
+		for (unsigned i = batch.drawCallAt(batch.triangleStarts, start); start < end; ++i) {
+			DrawCall& drawCall = batch.drawCalls[i];
+			unsigned first = batch.triangleStarts[i];
+			unsigned last = std::min(end, batch.triangleStarts[i+1]);
+			unsigned count = std::min(last - first, drawCall.triangleCount());
+			
+			if (start - first >= count) {
+				start = last;
+				continue;
+			}
+			
+			VertexCache* vertexCache = 0;
+			
+			if (r.fusedVertexShading && !drawCall.instanceBuffer.data) {
+				vertexCache = static_cast<VertexCache*>(r.vertexCaches[thread]);
+				
+				if (!vertexCache) {
+					vertexCache = static_cast<VertexCache*>(r.localAllocators[thread]->allocate(VertexCache::size(r.vertexCacheStride)));
+					vertexCache->drawCall = 0;
+					vertexCache->stamp = r.stateStamp;
+					r.vertexCaches[thread] = vertexCache;
+				}
+				
+				if (vertexCache->drawCall != &drawCall) {
+					vertexCache->clear();
+					vertexCache->drawCall = &drawCall;
+				}
+			}
+			
+			setupTriangles(r, drawCall, start - first, count, vertexCache);
+			start = last;
+		}
 	}
 	
 	virtual void finished() {
-		if (r.rasterizeDrawCallToHim && !r.dense)
-			r.rasterizeDrawCallToHim(r, drawCall);
+		if (r.rasterizeDrawCallsToHim && !r.dense)
+			r.rasterizeDrawCallsToHim(r, batch);
 	}
 };
 
-void setupDrawCallTriangles(Renderer& r, DrawCall& drawCall) {
-	ThreadPool& threadPool = r.getThreadPool();
-	
-	if (drawCall.indexBuffer.stride == 1) {
-		TriangleSetupTask<IndexProvider<unsigned char> >* t = new (drawCall.task) TriangleSetupTask<IndexProvider<unsigned char> >(r, drawCall, IndexProvider<unsigned char>(drawCall.indexBuffer.data));
-		threadPool.startTask(t, drawCall.indexBuffer.count, 3*1024, true);
-	}
-	else if (drawCall.indexBuffer.stride == 2) {
-		TriangleSetupTask<IndexProvider<unsigned short> >* t = new (drawCall.task) TriangleSetupTask<IndexProvider<unsigned short> >(r, drawCall, IndexProvider<unsigned short>(drawCall.indexBuffer.data));
-		threadPool.startTask(t, drawCall.indexBuffer.count, 3*1024, true);
-	}
-	else if (drawCall.indexBuffer.stride == 4) {
-		TriangleSetupTask<IndexProvider<unsigned int> >* t = new (drawCall.task) TriangleSetupTask<IndexProvider<unsigned int> >(r, drawCall, IndexProvider<unsigned int>(drawCall.indexBuffer.data));
-		threadPool.startTask(t, drawCall.indexBuffer.count, 3*1024, true);
-	}
-	else {
-		TriangleSetupTask<IndexProvider<> >* t = new (drawCall.task) TriangleSetupTask<IndexProvider<> >(r, drawCall, IndexProvider<>());
-		threadPool.startTask(t, drawCall.vertexBuffer.count, 3*1024, true);
-	}
+void setupDrawCallTriangles(Renderer& r, DrawCallBatch& batch) {
+	TriangleSetupTask* t = new (batch.task) TriangleSetupTask(r, batch);
+	r.getThreadPool().startTask(t, batch.triangleCount(), 1024, true);
 }
 
 }
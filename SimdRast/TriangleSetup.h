@@ -13,7 +13,7 @@
 
 namespace srast {
 
-void setupDrawCallTriangles(Renderer& r, DrawCall& drawCall);
+void setupDrawCallTriangles(Renderer& r, DrawCallBatch& batch);
 
 }
 
@@ -19,11 +19,8 @@ namespace srast {
 #define SRAST_FAR_Z 0.0f
 
 struct ZLessMode {
-	struct SortComparator {
-		bool operator () (unsigned long long a, unsigned long long b) const {
-			return a > b;
-		}
-	};
+	// Binned triangles sort front to back when their keys are in descending order.
+	static const bool sortDescending = true;
 
 	static simd_float min(const simd_float& a, const simd_float& b) {
 		return srast::max(a, b);
@@ -33,6 +30,10 @@ struct ZLessMode {
 		return srast::min(a, b);
 	}
 	
+	static simd_float min_reduce(const simd_float& a) {
+		return srast::max_reduce(a);
+	}
+	
 	static simd_float max_reduce(const simd_float& a) {
 		return srast::min_reduce(a);
 	}